@@ -0,0 +1,268 @@
+/*
+ * evdev-util.h -- helpers shared by the evdev/uinput tools
+ *
+ * Key names, uinput device creation and output frames, event timestamps
+ * and a latency histogram. Everything is static inline, include it from one .c file per tool.
+ *
+ * Public domain
+ */
+
+#ifndef EVDEV_UTIL_H
+#define EVDEV_UTIL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+typedef struct Key_name {
+    unsigned code;
+    const char *name;
+} Key_name;
+
+static const Key_name key_names[] = {
+#include "key_names.inc"
+};
+
+static inline const char *
+get_key_by_code(unsigned code)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(key_names) / sizeof(*key_names); i++)
+        if (key_names[i].code == code)
+            return key_names[i].name;
+    return NULL;
+}
+
+/* Key name without KEY_ (any case) or number, -1 if neither. */
+static inline int
+find_key_by_name(const char *name)
+{
+    size_t i;
+    unsigned code;
+    int off = 0;
+
+    for (i = 0; i < sizeof(key_names) / sizeof(*key_names); i++)
+        if (strcasecmp(key_names[i].name, name) == 0)
+            return key_names[i].code;
+    sscanf(name, "%i%n", &code, &off);
+    if (off == 0 || name[off] != 0 || code > KEY_MAX)
+        return -1;
+    return code;
+}
+
+/*
+ * Keyboard keys only: with the BTN_* ranges set, udev would also tag the
+ * device as a mouse or joystick.
+ */
+static inline void
+uinput_set_keyboard_keys(int fd)
+{
+    unsigned code;
+
+    ioctl(fd, UI_SET_EVBIT, EV_KEY);
+    for (code = 1; code < BTN_MISC; code++)
+        ioctl(fd, UI_SET_KEYBIT, code);
+    for (code = KEY_OK; code < BTN_DPAD_UP; code++)
+        ioctl(fd, UI_SET_KEYBIT, code);
+    for (code = KEY_ALS_TOGGLE; code < BTN_TRIGGER_HAPPY; code++)
+        ioctl(fd, UI_SET_KEYBIT, code);
+    for (code = BTN_TRIGGER_HAPPY40 + 1; code <= KEY_MAX; code++)
+        ioctl(fd, UI_SET_KEYBIT, code);
+}
+
+static inline void
+uinput_set_leds(int fd)
+{
+    unsigned led;
+
+    ioctl(fd, UI_SET_EVBIT, EV_LED);
+    for (led = 0; led < LED_CNT; led++)
+        ioctl(fd, UI_SET_LEDBIT, led);
+}
+
+/*
+ * LED changes written to the uinput device go to the n source fds,
+ * skipping those < 0. Devices without LEDs ignore them.
+ */
+static inline void
+uinput_forward_leds(int uinput, const int *fds, int n)
+{
+    struct input_event ev[16];
+    ssize_t rd;
+    int i, s;
+
+    while ((rd = read(uinput, ev, sizeof(ev))) > 0)
+        for (i = 0; i < rd / (ssize_t)sizeof(*ev); i++) {
+            if (ev[i].type != EV_LED &&
+                !(ev[i].type == EV_SYN && ev[i].code == SYN_REPORT))
+                continue;
+            for (s = 0; s < n; s++)
+                if (fds[s] >= 0 && write(fds[s], &ev[i], sizeof(ev[i])) < 0 &&
+                    errno != ENODEV)
+                    perror("LED write");
+        }
+}
+
+/* Capabilities must have been set with UI_SET_*BIT; returns fd or -1. */
+static inline int
+uinput_create(int fd, const char *name, unsigned short vendor,
+    unsigned short product)
+{
+    struct uinput_setup setup;
+
+    memset(&setup, 0, sizeof(setup));
+    snprintf(setup.name, sizeof(setup.name), "%s", name);
+    setup.id.bustype = BUS_VIRTUAL;
+    setup.id.vendor = vendor;
+    setup.id.product = product;
+    if (ioctl(fd, UI_DEV_SETUP, &setup) < 0 || ioctl(fd, UI_DEV_CREATE) < 0) {
+        perror("uinput");
+        return -1;
+    }
+    return fd;
+}
+
+static inline int
+uinput_open(void)
+{
+    int fd = open("/dev/uinput", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+    if (fd < 0)
+        perror("/dev/uinput");
+    return fd;
+}
+
+/*
+ * Output events are collected in a frame and go out in a single write(),
+ * closed by a SYN_REPORT. A full frame is written early, as a frame of
+ * its own, rather than dropping events.
+ */
+#define FRAME_MAX 256
+
+typedef struct Frame {
+    int fd;
+    int n;
+    struct input_event ev[FRAME_MAX];
+} Frame;
+
+/* Nothing to do if the frame is empty; -1 if the write failed. */
+static inline int
+frame_flush(Frame *f)
+{
+    struct input_event *ev;
+    ssize_t len;
+
+    if (f->n == 0)
+        return 0;
+    ev = &f->ev[f->n++];
+    memset(ev, 0, sizeof(*ev));
+    ev->type = EV_SYN;
+    ev->code = SYN_REPORT;
+    len = write(f->fd, f->ev, f->n * sizeof(*ev));
+    f->n = 0;
+    if (len < 0) {
+        perror("uinput write");
+        return -1;
+    }
+    return 0;
+}
+
+static inline void
+frame_emit(Frame *f, unsigned short type, unsigned short code, int value)
+{
+    struct input_event *ev;
+
+    // the last slot is kept for the SYN_REPORT
+    if (f->n == FRAME_MAX - 1)
+        frame_flush(f);
+    ev = &f->ev[f->n++];
+    memset(ev, 0, sizeof(*ev));
+    ev->type = type;
+    ev->code = code;
+    ev->value = value;
+}
+
+/* Event stamps are CLOCK_MONOTONIC once EVIOCSCLOCKID has been set. */
+static inline void
+use_monotonic_stamps(int fd)
+{
+    int clk = CLOCK_MONOTONIC;
+
+    ioctl(fd, EVIOCSCLOCKID, &clk);
+}
+
+static inline unsigned long long
+event_usec(const struct input_event *ev)
+{
+    return ev->input_event_sec * 1000000ULL + ev->input_event_usec;
+}
+
+static inline unsigned long long
+now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* 1 us buckets up to LATENCY_BUCKETS - 1, the last one takes the rest. */
+#define LATENCY_BUCKETS 2048
+
+typedef struct Latency {
+    unsigned long bucket[LATENCY_BUCKETS];
+    unsigned long count;
+    unsigned long long max;
+} Latency;
+
+static inline void
+latency_add(Latency *l, unsigned long long usec)
+{
+    l->bucket[usec < LATENCY_BUCKETS ? usec : LATENCY_BUCKETS - 1]++;
+    l->count++;
+    if (usec > l->max)
+        l->max = usec;
+}
+
+static inline unsigned
+latency_percentile(const Latency *l, double p)
+{
+    unsigned long want = l->count * p, seen = 0;
+    unsigned i;
+
+    if (l->count == 0)
+        return 0;
+    for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+        seen += l->bucket[i];
+        if (seen > want)
+            break;
+    }
+    return i;
+}
+
+/* One summary line, then the non-empty buckets if full is set. */
+static inline void
+latency_print(FILE *out, const char *what, const Latency *l, int full)
+{
+    unsigned i;
+
+    fprintf(out, "%s latency us: n=%lu p50=%u p90=%u p99=%u p99.9=%u max=%llu\n",
+        what, l->count, latency_percentile(l, 0.5), latency_percentile(l, 0.9),
+        latency_percentile(l, 0.99), latency_percentile(l, 0.999), l->max);
+    for (i = 0; full && i < LATENCY_BUCKETS; i++)
+        if (l->bucket[i])
+            fprintf(out, "%5u%s %lu\n", i, i == LATENCY_BUCKETS - 1 ? "+" : "",
+                l->bucket[i]);
+    fflush(out);
+}
+
+#endif
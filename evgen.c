@@ -0,0 +1,540 @@
+/*
+ * evgen -- synthetic evdev load generator
+ *
+ * Public domain
+ */
+
+/*
+Creates uinput keyboards and sends MSC_SCAN + EV_KEY + MSC_TIMESTAMP +
+SYN_REPORT frames to them at a target rate, to drive getscancodes,
+xi2watch, udev rules or evmap-remapd at realistic or extreme rates:
+
+$ sudo ./evgen -n 4 -r 100000 -t 10          # 100k key events/s on 4 devices
+$ sudo ./evgen -m keymap.txt -r 200 -t 60     # keys from a scancode map
+$ sudo ./evgen -f script.txt                  # scripted frames
+$ sudo ./evgen -n 20 -p 500 -t 30             # replug 20 devices every 500 ms
+$ sudo ./evgen -L /dev/input/event12          # latency of received frames
+
+MSC_TIMESTAMP carries the send time, CLOCK_MONOTONIC microseconds modulo
+2^32, so a reader can compute the end-to-end latency of each frame; -L is
+such a reader. Frames due in the same millisecond go out in one write()
+per device, so the rate holds up to hundreds of thousands of events/s.
+
+keymap.txt: "scancode keycode" per line, keycodes by name or number;
+without it, scancodes are 0x70000 | keycode for the -k range. The keymap
+only sets the MSC_SCAN and EV_KEY values sent: uinput devices have no
+keymap of their own, so evmap cannot read or change it.
+
+script.txt: "delay_us key value" per line: the frame is sent delay_us
+after the previous one, key by name or number, value 1 press, 0 release,
+2 repeat.
+
+The devices have the keyboard keys of evdev-util.h as capabilities by
+default; -C keys gives them only the keys evgen sends, -C all every key.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <linux/input.h>
+
+#include "evdev-util.h"
+
+#define MAX_DEVICES 256
+#define MAX_KEYS 1024
+#define BATCH_MAX 4096      // frames per device per write()
+
+typedef struct Key {
+    unsigned scancode;
+    unsigned short keycode;
+} Key;
+
+typedef struct Script_line {
+    unsigned delay;
+    unsigned short keycode;
+    int value;
+} Script_line;
+
+static Key keys[MAX_KEYS];
+static int nkeys;
+static int devices[MAX_DEVICES];
+static int ndevices = 1;
+static const char *dev_name = "evgen";
+static unsigned char used_keys[KEY_CNT];    // keycodes of keys[] and the script
+
+enum { CAPS_KEYBOARD, CAPS_KEYS, CAPS_ALL };
+static int caps = CAPS_KEYBOARD;
+static volatile sig_atomic_t stop;
+
+static void
+usage(int ret)
+{
+    FILE *out = ret ? stderr : stdout;
+
+    fprintf(out,
+        "evgen -- synthetic evdev load generator\n"
+        "Usage: evgen [-n devices] [-r rate] [-t seconds] [-c count] [-k first-last]\n"
+        "             [-m keymap] [-p replug_ms] [-C caps] [-N name]\n"
+        "       evgen -f script [-n devices] [-C caps] [-N name]\n"
+        "       evgen -L device\n"
+        "\n"
+        "    -n devices     uinput devices to create (default: 1)\n"
+        "    -r rate        key events per second, all devices (default: 1000)\n"
+        "    -t seconds     stop after this time\n"
+        "    -c count       stop after this many key events\n"
+        "    -k first-last  random keys in this keycode range (default: f13-f24)\n"
+        "    -m keymap      random keys from \"scancode keycode\" lines, sent as\n"
+        "                   MSC_SCAN + EV_KEY (the devices have no settable keymap)\n"
+        "    -f script      send \"delay_us key value\" lines instead of random keys\n"
+        "    -p replug_ms   unplug and replug all devices in a burst this often\n"
+        "    -C caps        key capabilities: keyboard (default), keys sent, all\n"
+        "    -N name        device name prefix (default: evgen)\n"
+        "    -L device      read device, print MSC_TIMESTAMP latency at exit\n"
+        "    -h             print this message\n"
+        );
+    fflush(out);
+    if (ret)
+        exit(ret);
+}
+
+static void
+on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static int
+parse_key(const char *name)
+{
+    int code = find_key_by_name(name);
+
+    if (code <= 0) {
+        fprintf(stderr, "Unknown key: %s\n", name);
+        exit(1);
+    }
+    return code;
+}
+
+static void
+add_key(unsigned scancode, unsigned short keycode)
+{
+    if (nkeys == MAX_KEYS) {
+        fprintf(stderr, "Too many keys\n");
+        exit(1);
+    }
+    keys[nkeys].scancode = scancode;
+    keys[nkeys].keycode = keycode;
+    used_keys[keycode] = 1;
+    nkeys++;
+}
+
+static void
+load_keymap(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    char line[256], name[64];
+    unsigned scancode;
+
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "%x %63s", &scancode, name) == 2)
+            add_key(scancode, parse_key(name));
+    fclose(f);
+    if (nkeys == 0) {
+        fprintf(stderr, "No keys in %s\n", path);
+        exit(1);
+    }
+}
+
+static Script_line *
+load_script(const char *path, int *n)
+{
+    FILE *f = fopen(path, "r");
+    char line[256], name[64];
+    Script_line *script = NULL, *l;
+    void *p;
+    int size = 0;
+
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    *n = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (*n == size) {
+            size = size ? size * 2 : 256;
+            p = realloc(script, size * sizeof(*script));
+            if (p == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            script = p;
+        }
+        l = &script[*n];
+        if (sscanf(line, "%u %63s %d", &l->delay, name, &l->value) != 3)
+            continue;
+        l->keycode = parse_key(name);
+        used_keys[l->keycode] = 1;
+        (*n)++;
+    }
+    fclose(f);
+    return script;
+}
+
+static int
+create_device(int i)
+{
+    char name[UINPUT_MAX_NAME_SIZE];
+    int fd = uinput_open();
+    unsigned code;
+
+    if (fd < 0)
+        return -1;
+    if (caps == CAPS_KEYBOARD) {
+        uinput_set_keyboard_keys(fd);
+    } else {
+        ioctl(fd, UI_SET_EVBIT, EV_KEY);
+        for (code = 1; code < KEY_CNT; code++)
+            if (caps == CAPS_ALL || used_keys[code])
+                ioctl(fd, UI_SET_KEYBIT, code);
+    }
+    ioctl(fd, UI_SET_EVBIT, EV_MSC);
+    ioctl(fd, UI_SET_MSCBIT, MSC_SCAN);
+    ioctl(fd, UI_SET_MSCBIT, MSC_TIMESTAMP);
+    snprintf(name, sizeof(name), "%s %d", dev_name, i);
+    if (uinput_create(fd, name, 0x4576, 0x6765) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void
+destroy_device(int fd)
+{
+    ioctl(fd, UI_DEV_DESTROY);
+    close(fd);
+}
+
+/* Unplugs and replugs all devices, returns the time taken in us. */
+static unsigned long long
+replug(void)
+{
+    unsigned long long t0 = now_usec();
+    int i;
+
+    for (i = 0; i < ndevices; i++)
+        destroy_device(devices[i]);
+    for (i = 0; i < ndevices; i++)
+        if ((devices[i] = create_device(i)) < 0)
+            exit(1);
+    return now_usec() - t0;
+}
+
+static int
+set_event(struct input_event *ev, unsigned short type, unsigned short code, int value)
+{
+    memset(ev, 0, sizeof(*ev));
+    ev->type = type;
+    ev->code = code;
+    ev->value = value;
+    return 1;
+}
+
+/* One frame: MSC_SCAN, EV_KEY, MSC_TIMESTAMP, SYN_REPORT. */
+static int
+set_frame(struct input_event *ev, unsigned scancode, unsigned short keycode,
+    int value, unsigned long long stamp)
+{
+    set_event(&ev[0], EV_MSC, MSC_SCAN, scancode);
+    set_event(&ev[1], EV_KEY, keycode, value);
+    set_event(&ev[2], EV_MSC, MSC_TIMESTAMP, (int)(unsigned)stamp);
+    set_event(&ev[3], EV_SYN, SYN_REPORT, 0);
+    return 4;
+}
+
+static unsigned
+rnd(void)
+{
+    static unsigned state = 2463534242U;
+
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+static void
+sleep_until(unsigned long long usec)
+{
+    struct timespec ts = { usec / 1000000, usec % 1000000 * 1000 };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !stop)
+        ;
+}
+
+static void
+write_frames(int fd, const struct input_event *ev, int n, unsigned long *errors)
+{
+    if (write(fd, ev, n * sizeof(*ev)) < 0)
+        (*errors)++;
+}
+
+/*
+ * Random keys, each pressed then released by the next frame of its
+ * device. Every millisecond the frames due by then are written, one
+ * write() per device.
+ */
+static unsigned long
+run_random(double rate, unsigned long long duration, unsigned long count,
+    unsigned replug_ms, unsigned long *errors)
+{
+    static struct input_event batch[BATCH_MAX * 4];
+    static int pressed[MAX_DEVICES];      // key index + 1
+    unsigned long long start = now_usec(), now, next_replug, plug_us = 0;
+    unsigned long sent = 0, due, todo, share, m, replugs = 0;
+    int d, n, k;
+
+    next_replug = replug_ms ? start + replug_ms * 1000ULL : 0;
+    while (!stop && (!count || sent < count)) {
+        now = now_usec();
+        if (duration && now - start >= duration)
+            break;
+        if (next_replug && now >= next_replug) {
+            plug_us += replug();
+            memset(pressed, 0, sizeof(pressed));
+            replugs++;
+            next_replug += replug_ms * 1000ULL;
+        }
+        due = (now - start) * rate / 1e6;
+        if (count && due > count)
+            due = count;
+        todo = due > sent ? due - sent : 0;
+        share = (todo + ndevices - 1) / ndevices;
+        if (share > BATCH_MAX)
+            share = BATCH_MAX;
+        for (d = 0; d < ndevices && todo; d++) {
+            for (m = n = 0; m < share && m < todo; m++) {
+                if (pressed[d]) {
+                    k = pressed[d] - 1;
+                    n += set_frame(&batch[n], keys[k].scancode, keys[k].keycode, 0, now);
+                    pressed[d] = 0;
+                } else {
+                    k = rnd() % nkeys;
+                    n += set_frame(&batch[n], keys[k].scancode, keys[k].keycode, 1, now);
+                    pressed[d] = k + 1;
+                }
+            }
+            write_frames(devices[d], batch, n, errors);
+            sent += m;
+            todo -= m;
+        }
+        sleep_until(now + 1000);
+    }
+    for (d = 0; d < ndevices; d++)
+        if (pressed[d]) {
+            k = pressed[d] - 1;
+            n = set_frame(batch, keys[k].scancode, keys[k].keycode, 0, now_usec());
+            write_frames(devices[d], batch, n, errors);
+        }
+    if (replugs)
+        fprintf(stderr, "replugged %d devices %lu times, %.0f us per burst\n",
+            ndevices, replugs, (double)plug_us / replugs);
+    return sent;
+}
+
+static unsigned long
+run_script(const Script_line *script, int nlines, unsigned long *errors)
+{
+    struct input_event ev[4];
+    unsigned long long t = now_usec();
+    unsigned long sent = 0;
+    unsigned scancode;
+    int i, d, n;
+
+    for (i = 0; i < nlines && !stop; i++) {
+        t += script[i].delay;
+        sleep_until(t);
+        scancode = 0x70000 | script[i].keycode;
+        for (d = 0; d < ndevices; d++) {
+            n = set_frame(ev, scancode, script[i].keycode, script[i].value, now_usec());
+            write_frames(devices[d], ev, n, errors);
+            sent++;
+        }
+    }
+    return sent;
+}
+
+/* Reader side: latency of each frame from its MSC_TIMESTAMP. */
+static int
+run_reader(const char *path)
+{
+    struct input_event ev[64];
+    static Latency latency;
+    unsigned now;
+    ssize_t rd;
+    int fd, i;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+    while (!stop) {
+        rd = read(fd, ev, sizeof(ev));
+        if (rd < (ssize_t)sizeof(*ev)) {
+            if (rd < 0 && errno == EINTR)
+                continue;
+            perror("evgen: error reading");
+            break;
+        }
+        now = now_usec();
+        for (i = 0; i < rd / (ssize_t)sizeof(*ev); i++)
+            if (ev[i].type == EV_MSC && ev[i].code == MSC_TIMESTAMP)
+                latency_add(&latency, now - (unsigned)ev[i].value);
+    }
+    latency_print(stdout, "end-to-end", &latency, 0);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *script_path = NULL, *reader = NULL;
+    Script_line *script = NULL;
+    double rate = 1000;
+    unsigned long long duration = 0, t0;
+    unsigned long count = 0, sent, errors = 0;
+    unsigned first = KEY_F13, last = KEY_F24, replug_ms = 0;
+    struct sigaction sa;
+    int opt, i, nlines = 0, random_opts = 0, range_set = 0;
+    char a[64], b[64];
+
+    while ((opt = getopt(argc, argv, "n:r:t:c:k:m:f:p:C:N:L:h")) >= 0) {
+        if (strchr("rtckmp", opt))
+            random_opts++;
+        switch (opt) {
+            case 'n':
+                ndevices = atoi(optarg);
+                if (ndevices < 1 || ndevices > MAX_DEVICES)
+                    usage(1);
+                break;
+
+            case 'r':
+                rate = atof(optarg);
+                if (rate <= 0)
+                    usage(1);
+                break;
+
+            case 't':
+                duration = atof(optarg) * 1e6;
+                break;
+
+            case 'c':
+                count = strtoul(optarg, NULL, 0);
+                break;
+
+            case 'k':
+                if (sscanf(optarg, "%63[^-]-%63s", a, b) != 2)
+                    usage(1);
+                first = parse_key(a);
+                last = parse_key(b);
+                if (first > last) {
+                    fprintf(stderr, "Empty key range: %s\n", optarg);
+                    exit(1);
+                }
+                range_set = 1;
+                break;
+
+            case 'm':
+                load_keymap(optarg);
+                break;
+
+            case 'f':
+                script_path = optarg;
+                break;
+
+            case 'p':
+                replug_ms = atoi(optarg);
+                break;
+
+            case 'C':
+                if (strcmp(optarg, "keyboard") == 0)
+                    caps = CAPS_KEYBOARD;
+                else if (strcmp(optarg, "keys") == 0)
+                    caps = CAPS_KEYS;
+                else if (strcmp(optarg, "all") == 0)
+                    caps = CAPS_ALL;
+                else
+                    usage(1);
+                break;
+
+            case 'N':
+                dev_name = optarg;
+                break;
+
+            case 'L':
+                reader = optarg;
+                break;
+
+            case 'h':
+                usage(0);
+                exit(0);
+
+            default:
+                usage(1);
+        }
+    }
+    if (optind < argc)
+        usage(1);
+    if (range_set && nkeys) {
+        fprintf(stderr, "-k and -m are exclusive\n");
+        exit(1);
+    }
+    if (script_path && random_opts) {
+        fprintf(stderr, "-r, -t, -c, -k, -m and -p do not apply to -f scripts\n");
+        exit(1);
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if (reader)
+        return run_reader(reader);
+
+    if (script_path)
+        script = load_script(script_path, &nlines);
+    else if (nkeys == 0)
+        for (i = first; i <= (int)last; i++)
+            add_key(0x70000 | i, i);
+
+    for (i = 0; i < ndevices; i++)
+        if ((devices[i] = create_device(i)) < 0)
+            exit(1);
+    // let udev and readers pick the new devices up
+    sleep(1);
+
+    t0 = now_usec();
+    if (script_path) {
+        sent = run_script(script, nlines, &errors);
+        free(script);
+    } else {
+        sent = run_random(rate, duration, count, replug_ms, &errors);
+    }
+    t0 = now_usec() - t0;
+    fprintf(stderr, "sent %lu key events in %.3f s, %.0f/s, %lu write errors\n",
+        sent, t0 / 1e6, sent / (t0 / 1e6), errors);
+
+    for (i = 0; i < ndevices; i++)
+        destroy_device(devices[i]);
+    return 0;
+}
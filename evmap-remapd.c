@@ -0,0 +1,511 @@
+/*
+ * evmap-remapd -- remap grabbed evdev keyboards through one uinput device
+ *
+ * Public domain
+ */
+
+/*
+EVIOCSKEYCODE_V2 tables (evmap) map one scancode to one keycode per
+device, and loadkeys is global. evmap-remapd grabs the source devices and
+re-emits their keys through a single uinput keyboard, translated by rules
+that can depend on the modifiers held and differ per device:
+
+$ sudo ./evmap-remapd -m capslock=esc \
+    -d /dev/input/by-id/usb-Foo-event-kbd -m shift+2=apostrophe -m 102nd=0x0 \
+    -d /dev/input/event6 -m altgr+e=shift+apostrophe
+
+Rules given before the first -d apply to all devices, the others to the
+last -d. A rule is [mods+]key=[mods+]key, mods being shift, ctrl, alt,
+altgr and meta. The rule with the most modifiers among those held wins;
+modifiers of the rule not on the output side are released around the
+output key, output modifiers not held are pressed around it. 0x0 drops
+the key.
+
+Rules are compiled into a dense table per device, indexed by keycode and
+modifier state, so an event costs one lookup. All output events of an
+input SYN_REPORT frame go out in a single write(). Modifier state is
+per device: the modifiers held on one keyboard do not pick the rules of
+another. The latency from the
+kernel stamp of the input frame to the end of that write() is kept in a
+histogram, printed on SIGUSR1 and at exit (-H: every bucket).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <linux/input.h>
+
+#include "evdev-util.h"
+
+enum { MOD_SHIFT, MOD_CTRL, MOD_ALT, MOD_ALTGR, MOD_META, MOD_CNT };
+#define MOD_STATES (1 << MOD_CNT)
+
+static const struct {
+    const char *name;
+    unsigned short key[2];  // key[0] is pressed when the output needs it
+} mods[MOD_CNT] = {
+    [MOD_SHIFT] = { "shift", { KEY_LEFTSHIFT, KEY_RIGHTSHIFT } },
+    [MOD_CTRL]  = { "ctrl",  { KEY_LEFTCTRL, KEY_RIGHTCTRL } },
+    [MOD_ALT]   = { "alt",   { KEY_LEFTALT } },
+    [MOD_ALTGR] = { "altgr", { KEY_RIGHTALT } },
+    [MOD_META]  = { "meta",  { KEY_LEFTMETA, KEY_RIGHTMETA } },
+};
+
+/* code 0 drops the key; mods are held and consume released around it */
+typedef struct Output {
+    unsigned short code;
+    unsigned char mods;
+    unsigned char consume;
+} Output;
+
+typedef struct Rule {
+    unsigned short from;
+    unsigned char mods;
+    Output out;
+} Rule;
+
+#define MAX_RULES 1024
+#define MAX_SOURCES 32
+
+typedef struct Source {
+    int fd;
+    const char *path;
+    int dropped;                // SYN_DROPPED seen, resync at SYN_REPORT
+    Rule *rules;                // device rules, applied after the global ones
+    int nrules;
+    Output (*table)[MOD_STATES];
+    Output active[KEY_CNT];     // output of each pressed key, code 0 if none
+    unsigned char down[KEY_CNT];
+    unsigned char held[KEY_CNT];    // pressed keys per output keycode
+} Source;
+
+static Rule global_rules[MAX_RULES];
+static int nglobal;
+static Source sources[MAX_SOURCES];
+static int nsources;
+
+static Frame frame = { .fd = -1 };
+static unsigned char out_down[KEY_CNT];
+static Latency latency;
+
+static void
+usage(int ret)
+{
+    FILE *out = ret ? stderr : stdout;
+
+    fprintf(out,
+        "evmap-remapd -- remap grabbed evdev keyboards through uinput\n"
+        "Usage: evmap-remapd [-n name] [-H] [-m rule]... -d device [-m rule]...\n"
+        "\n"
+        "    -d device     grab a source device, following -m rules apply to it\n"
+        "    -m rule       [mods+]key=[mods+]key, mods: shift ctrl alt altgr meta\n"
+        "                  (key names or numbers; 0x0 drops the key)\n"
+        "    -n name       name of the uinput device (default: evmap-remapd)\n"
+        "    -H            print the whole latency histogram, not only percentiles\n"
+        "    -h            print this message\n"
+        "Rules before the first -d apply to all devices. SIGUSR1 prints the\n"
+        "latency histogram.\n"
+        );
+    fflush(out);
+    if (ret)
+        exit(ret);
+}
+
+/* Parses [mods+]key into *mask and the keycode, exits on error. */
+static unsigned short
+parse_chord(const char *spec, unsigned char *mask)
+{
+    char buf[64], *p, *plus;
+    int i, code;
+
+    snprintf(buf, sizeof(buf), "%s", spec);
+    *mask = 0;
+    for (p = buf; (plus = strchr(p, '+')) != NULL; p = plus + 1) {
+        *plus = 0;
+        for (i = 0; i < MOD_CNT && strcasecmp(mods[i].name, p) != 0; i++)
+            ;
+        if (i == MOD_CNT) {
+            fprintf(stderr, "Unknown modifier: %s\n", p);
+            exit(1);
+        }
+        *mask |= 1 << i;
+    }
+    code = find_key_by_name(p);
+    if (code < 0) {
+        fprintf(stderr, "Unknown key: %s\n", p);
+        exit(1);
+    }
+    return code;
+}
+
+static void
+add_rule(const char *def)
+{
+    Source *src = nsources ? &sources[nsources - 1] : NULL;
+    char from[64];
+    const char *sep = strchr(def, '=');
+    Rule *r;
+
+    if (sep == NULL || (size_t)(sep - def) >= sizeof(from)) {
+        fprintf(stderr, "Invalid rule: %s\n", def);
+        exit(1);
+    }
+    if ((src ? src->nrules : nglobal) >= MAX_RULES) {
+        fprintf(stderr, "Too many rules\n");
+        exit(1);
+    }
+    if (src) {
+        if (src->rules == NULL)
+            src->rules = calloc(MAX_RULES, sizeof(Rule));
+        if (src->rules == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        r = &src->rules[src->nrules++];
+    } else {
+        r = &global_rules[nglobal++];
+    }
+    memcpy(from, def, sep - def);
+    from[sep - def] = 0;
+    r->from = parse_chord(from, &r->mods);
+    r->out.code = parse_chord(sep + 1, &r->out.mods);
+    r->out.consume = r->mods & ~r->out.mods;
+}
+
+static int
+popcount(unsigned v)
+{
+    int n = 0;
+
+    for (; v; v &= v - 1)
+        n++;
+    return n;
+}
+
+static void
+fill_rules(Output (*table)[MOD_STATES], const Rule *rules, int n, int nmods)
+{
+    int i, s;
+
+    for (i = 0; i < n; i++) {
+        if (popcount(rules[i].mods) != nmods)
+            continue;
+        for (s = 0; s < MOD_STATES; s++)
+            if ((s & rules[i].mods) == rules[i].mods)
+                table[rules[i].from][s] = rules[i].out;
+    }
+}
+
+/*
+ * Identity first, then the rules by increasing number of modifiers, the
+ * device ones after the global ones, so the most specific rule wins.
+ */
+static void
+compile(Source *src)
+{
+    int k, s, m;
+
+    src->table = calloc(KEY_CNT, sizeof(*src->table));
+    if (src->table == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (k = 0; k < KEY_CNT; k++)
+        for (s = 0; s < MOD_STATES; s++)
+            src->table[k][s].code = k;
+    for (m = 0; m <= MOD_CNT; m++) {
+        fill_rules(src->table, global_rules, nglobal, m);
+        fill_rules(src->table, src->rules, src->nrules, m);
+    }
+}
+
+static void
+emit(unsigned short type, unsigned short code, int value)
+{
+    frame_emit(&frame, type, code, value);
+    if (type == EV_KEY && value != 2)
+        out_down[code] = value != 0;
+}
+
+/* Modifiers held through the keys of src, whatever the other devices hold. */
+static unsigned
+mod_state(const Source *src)
+{
+    unsigned s = 0;
+    int m;
+
+    for (m = 0; m < MOD_CNT; m++)
+        if (src->held[mods[m].key[0]] || (mods[m].key[1] && src->held[mods[m].key[1]]))
+            s |= 1 << m;
+    return s;
+}
+
+/*
+ * Emits out with value, pressing its modifiers and releasing the consumed
+ * ones first and putting them back after.
+ */
+static void
+emit_output(const Output *out, int value)
+{
+    unsigned char released[MOD_CNT][2] = { { 0 } };
+    unsigned char pressed[MOD_CNT] = { 0 };
+    int m, j;
+
+    for (m = 0; m < MOD_CNT; m++) {
+        for (j = 0; j < 2; j++)
+            if ((out->consume & 1 << m) && mods[m].key[j] && out_down[mods[m].key[j]]) {
+                emit(EV_KEY, mods[m].key[j], 0);
+                released[m][j] = 1;
+            }
+        if ((out->mods & 1 << m) && !out_down[mods[m].key[0]] &&
+            !(mods[m].key[1] && out_down[mods[m].key[1]])) {
+            emit(EV_KEY, mods[m].key[0], 1);
+            pressed[m] = 1;
+        }
+    }
+    emit(EV_KEY, out->code, value);
+    for (m = 0; m < MOD_CNT; m++) {
+        if (pressed[m])
+            emit(EV_KEY, mods[m].key[0], 0);
+        for (j = 0; j < 2; j++)
+            if (released[m][j])
+                emit(EV_KEY, mods[m].key[j], 1);
+    }
+}
+
+static void
+key_event(Source *src, unsigned short code, int value)
+{
+    Output *act = &src->active[code];
+
+    if (value == 0) {
+        if (src->down[code] && act->code) {
+            emit(EV_KEY, act->code, 0);
+            src->held[act->code]--;
+        }
+        src->down[code] = 0;
+        return;
+    }
+    if (value == 1) {
+        if (src->down[code])
+            return;
+        *act = src->table[code][mod_state(src)];
+        src->down[code] = 1;
+        if (act->code == 0)
+            return;
+        src->held[act->code]++;
+        // modifiers only wrap the press, a held key repeats the same way
+        emit_output(act, 1);
+        return;
+    }
+    if (src->down[code] && act->code)
+        emit_output(act, 2);
+}
+
+/* After SYN_DROPPED: release what the device no longer reports as down. */
+static void
+resync(Source *src)
+{
+    unsigned char keys[KEY_MAX / 8 + 1];
+    int k;
+
+    memset(keys, 0, sizeof(keys));
+    ioctl(src->fd, EVIOCGKEY(sizeof(keys)), keys);
+    for (k = 0; k < KEY_CNT; k++)
+        if (src->down[k] && !(keys[k / 8] & 1 << (k % 8)))
+            key_event(src, k, 0);
+    src->dropped = 0;
+}
+
+/* stamp: kernel time of the input frame */
+static void
+flush_frame(unsigned long long stamp)
+{
+    if (frame.n == 0)
+        return;
+    frame_flush(&frame);
+    latency_add(&latency, now_usec() - stamp);
+}
+
+static void
+close_source(Source *src)
+{
+    fprintf(stderr, "%s: gone\n", src->path);
+    close(src->fd);
+    src->fd = -1;
+    for (int k = 0; k < KEY_CNT; k++)
+        if (src->down[k])
+            key_event(src, k, 0);
+}
+
+static int
+read_source(Source *src)
+{
+    struct input_event ev[64];
+    ssize_t rd;
+    int i, n;
+
+    rd = read(src->fd, ev, sizeof(ev));
+    if (rd < 0 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+    if (rd < (ssize_t)sizeof(*ev)) {
+        close_source(src);
+        return -1;
+    }
+    n = rd / sizeof(*ev);
+    for (i = 0; i < n; i++) {
+        if (ev[i].type == EV_SYN && ev[i].code == SYN_DROPPED) {
+            src->dropped = 1;
+            continue;
+        }
+        if (ev[i].type == EV_SYN && ev[i].code == SYN_REPORT) {
+            if (src->dropped)
+                resync(src);
+            flush_frame(event_usec(&ev[i]));
+            continue;
+        }
+        if (!src->dropped && ev[i].type == EV_KEY && ev[i].code < KEY_CNT)
+            key_event(src, ev[i].code, ev[i].value);
+    }
+    return 0;
+}
+
+/* LED changes written to the uinput device go to all sources. */
+static void
+read_uinput(void)
+{
+    int fds[MAX_SOURCES], s;
+
+    for (s = 0; s < nsources; s++)
+        fds[s] = sources[s].fd;
+    uinput_forward_leds(frame.fd, fds, nsources);
+}
+
+static int
+open_uinput(const char *name)
+{
+    int fd = uinput_open();
+
+    if (fd < 0)
+        return -1;
+    uinput_set_keyboard_keys(fd);
+    uinput_set_leds(fd);
+    return uinput_create(fd, name, 0x4576, 0x6d72);
+}
+
+int main(int argc, char **argv)
+{
+    const char *name = "evmap-remapd";
+    struct epoll_event ee, events[MAX_SOURCES + 2];
+    sigset_t sigs;
+    int opt, full = 0, ep, sfd, live, i, n;
+
+    while ((opt = getopt(argc, argv, "d:m:n:Hh")) >= 0) {
+        switch (opt) {
+            case 'd':
+                if (nsources == MAX_SOURCES) {
+                    fprintf(stderr, "Too many devices\n");
+                    exit(1);
+                }
+                sources[nsources].path = optarg;
+                sources[nsources].fd = open(optarg, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+                if (sources[nsources].fd < 0) {
+                    perror(optarg);
+                    exit(1);
+                }
+                nsources++;
+                break;
+
+            case 'm':
+                add_rule(optarg);
+                break;
+
+            case 'n':
+                name = optarg;
+                break;
+
+            case 'H':
+                full = 1;
+                break;
+
+            case 'h':
+                usage(0);
+                exit(0);
+
+            default:
+                usage(1);
+        }
+    }
+    if (optind < argc || nsources == 0)
+        usage(1);
+
+    frame.fd = open_uinput(name);
+    if (frame.fd < 0)
+        exit(1);
+
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &sigs, NULL);
+    sfd = signalfd(-1, &sigs, SFD_CLOEXEC);
+
+    ep = epoll_create1(EPOLL_CLOEXEC);
+    ee.events = EPOLLIN;
+    ee.data.u32 = MAX_SOURCES;
+    epoll_ctl(ep, EPOLL_CTL_ADD, frame.fd, &ee);
+    ee.data.u32 = MAX_SOURCES + 1;
+    epoll_ctl(ep, EPOLL_CTL_ADD, sfd, &ee);
+
+    for (i = 0; i < nsources; i++) {
+        compile(&sources[i]);
+        use_monotonic_stamps(sources[i].fd);
+        if (ioctl(sources[i].fd, EVIOCGRAB, 1) < 0) {
+            perror(sources[i].path);
+            exit(1);
+        }
+        ee.data.u32 = i;
+        epoll_ctl(ep, EPOLL_CTL_ADD, sources[i].fd, &ee);
+    }
+
+    for (live = nsources; live > 0; ) {
+        n = epoll_wait(ep, events, MAX_SOURCES + 2, -1);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            unsigned id = events[i].data.u32;
+
+            if (id < MAX_SOURCES) {
+                if (sources[id].fd >= 0 && read_source(&sources[id]) < 0) {
+                    // keys released by close_source()
+                    flush_frame(now_usec());
+                    live--;
+                }
+            } else if (id == MAX_SOURCES) {
+                read_uinput();
+            } else {
+                struct signalfd_siginfo si;
+
+                if (read(sfd, &si, sizeof(si)) != sizeof(si))
+                    continue;
+                latency_print(stderr, "frame", &latency, full);
+                if (si.ssi_signo != SIGUSR1)
+                    live = 0;
+            }
+        }
+    }
+
+    for (i = 0; i < nsources; i++)
+        if (sources[i].fd >= 0)
+            ioctl(sources[i].fd, EVIOCGRAB, 0);
+    ioctl(frame.fd, UI_DEV_DESTROY);
+    return 0;
+}
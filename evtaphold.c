@@ -0,0 +1,528 @@
+/*
+ * evtaphold -- tap-hold keys and layers for a grabbed evdev keyboard
+ *
+ * Public domain
+ */
+
+/*
+Dual-role keys and layers, which EVIOCSKEYCODE_V2 tables cannot express:
+
+$ sudo ./evtaphold -d /dev/input/event3 -t 180 \
+    -k capslock=esc/leftctrl -k space=space/layer1 \
+    -l 1:h=left -l 1:j=down -l 1:k=up -l 1:l=right
+
+A dual-role key is a tap if it is released within the tapping term and
+before another key is pressed, otherwise a hold. A hold of a layerN key
+switches layer N on while the key is down; -l mappings of the highest
+active layer win, keys not mapped there fall through to lower layers.
+
+Decisions use the kernel timestamps of the events (EVIOCSCLOCKID
+CLOCK_MONOTONIC), not the time they are read: a key released within the
+term is a tap even if the reader ran late, and a hold is decided exactly
+at press + term. Pending deadlines live in a timer wheel with 1 ms slots
+behind a single absolute timerfd in the epoll loop, so nothing polls or
+sleeps and the added latency is at most the tapping term, for dual-role
+keys only; other keys go through in the frame they came in.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <linux/input.h>
+
+#include "evdev-util.h"
+
+#define LAYERS 8
+#define TERM_MAX_MS 1000
+
+typedef struct Timer {
+    struct Timer *next;
+    unsigned long long deadline;    // us, CLOCK_MONOTONIC
+    unsigned short key;
+    unsigned char armed;
+} Timer;
+
+enum { DUAL_NONE, DUAL_PENDING, DUAL_HOLD };
+
+typedef struct Dual {
+    unsigned short tap;
+    unsigned short hold;        // keycode, or 0 with layer set
+    unsigned char layer;
+    unsigned char state;
+    Timer timer;
+} Dual;
+
+static Dual *duals[KEY_CNT];
+static unsigned short layer_map[LAYERS][KEY_CNT];  // 0: not mapped
+static unsigned layers = 1;                         // bit 0: base layer
+static unsigned short active[KEY_CNT];              // output of each pressed key
+static unsigned long long term = 200000;
+static int npending;
+
+static int dev = -1, tfd = -1;
+static Frame frame = { .fd = -1 };
+
+/*
+ * Timer wheel: more than TERM_MAX_MS slots of 1 ms, so every pending
+ * deadline is less than one turn ahead and a slot never mixes turns. The timerfd
+ * is armed to the earliest deadline.
+ */
+#define WHEEL_SLOTS 1024
+static Timer *wheel[WHEEL_SLOTS];
+static unsigned long long wheel_ms;  // last ms expired
+
+static void
+timer_add(Timer *t, unsigned long long deadline)
+{
+    Timer **slot;
+
+    // from an event stamped before the last expiry: due at once
+    if (deadline / 1000 < wheel_ms)
+        deadline = wheel_ms * 1000;
+    slot = &wheel[deadline / 1000 % WHEEL_SLOTS];
+    t->deadline = deadline;
+    t->next = *slot;
+    t->armed = 1;
+    *slot = t;
+}
+
+static void
+timer_del(Timer *t)
+{
+    Timer **p;
+
+    if (!t->armed)
+        return;
+    for (p = &wheel[t->deadline / 1000 % WHEEL_SLOTS]; *p != t; p = &(*p)->next)
+        ;
+    *p = t->next;
+    t->armed = 0;
+}
+
+static void
+timer_arm(void)
+{
+    struct itimerspec its;
+    unsigned long long ms, next = 0;
+    Timer *t;
+
+    for (ms = wheel_ms; ms < wheel_ms + WHEEL_SLOTS && !next; ms++)
+        for (t = wheel[ms % WHEEL_SLOTS]; t; t = t->next)
+            if (!next || t->deadline < next)
+                next = t->deadline;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = next / 1000000;
+    its.it_value.tv_nsec = next % 1000000 * 1000;
+    if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        perror("timerfd_settime");
+}
+
+static void
+usage(int ret)
+{
+    FILE *out = ret ? stderr : stdout;
+
+    fprintf(out,
+        "evtaphold -- tap-hold keys and layers for a grabbed evdev keyboard\n"
+        "Usage: evtaphold -d device [-t ms] [-k key=tap/hold]... [-l N:key=out]...\n"
+        "\n"
+        "    -d device        grab the input device\n"
+        "    -t ms            tapping term (default: 200, max: %d)\n"
+        "    -k key=tap/hold  dual-role key, hold is a key or layer1..layer%d\n"
+        "    -l N:key=out     map key to out while layer N is held\n"
+        "    -n name          name of the uinput device (default: evtaphold)\n"
+        "    -h               print this message\n",
+        TERM_MAX_MS, LAYERS - 1);
+    fflush(out);
+    if (ret)
+        exit(ret);
+}
+
+static int
+parse_key(const char *name)
+{
+    int code = find_key_by_name(name);
+
+    if (code <= 0) {
+        fprintf(stderr, "Unknown key: %s\n", name);
+        exit(1);
+    }
+    return code;
+}
+
+static void
+add_dual(const char *def)
+{
+    char buf[128], *tap, *hold;
+    unsigned layer;
+    int key, off = 0;
+    Dual *d;
+
+    snprintf(buf, sizeof(buf), "%s", def);
+    tap = strchr(buf, '=');
+    hold = tap ? strchr(tap, '/') : NULL;
+    if (hold == NULL) {
+        fprintf(stderr, "Invalid dual-role key: %s\n", def);
+        exit(1);
+    }
+    *tap++ = 0;
+    *hold++ = 0;
+    key = parse_key(buf);
+    d = duals[key] ? duals[key] : calloc(1, sizeof(*d));
+    if (d == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    d->tap = parse_key(tap);
+    if (sscanf(hold, "layer%u%n", &layer, &off) == 1 && hold[off] == 0) {
+        if (layer == 0 || layer >= LAYERS) {
+            fprintf(stderr, "Invalid layer: %s\n", hold);
+            exit(1);
+        }
+        d->layer = layer;
+        d->hold = 0;
+    } else {
+        d->hold = parse_key(hold);
+    }
+    duals[key] = d;
+}
+
+static void
+add_layer_map(const char *def)
+{
+    char buf[128], *out;
+    unsigned layer;
+    int off = 0;
+
+    snprintf(buf, sizeof(buf), "%s", def);
+    out = strchr(buf, '=');
+    if (sscanf(buf, "%u:%n", &layer, &off) != 1 || !off || out == NULL ||
+        layer == 0 || layer >= LAYERS) {
+        fprintf(stderr, "Invalid layer mapping: %s\n", def);
+        exit(1);
+    }
+    *out++ = 0;
+    layer_map[layer][parse_key(buf + off)] = parse_key(out);
+}
+
+static void
+emit(unsigned short type, unsigned short code, int value)
+{
+    frame_emit(&frame, type, code, value);
+}
+
+static void
+flush_frame(void)
+{
+    frame_flush(&frame);
+}
+
+static unsigned short
+lookup(unsigned short code)
+{
+    int l;
+
+    for (l = LAYERS - 1; l > 0; l--)
+        if ((layers & 1 << l) && layer_map[l][code])
+            return layer_map[l][code];
+    return code;
+}
+
+static void
+resolve_hold(unsigned short code)
+{
+    Dual *d = duals[code];
+
+    timer_del(&d->timer);
+    npending--;
+    d->state = DUAL_HOLD;
+    if (d->layer) {
+        layers |= 1 << d->layer;
+    } else {
+        active[code] = d->hold;
+        emit(EV_KEY, d->hold, 1);
+    }
+}
+
+/* Pending keys become holds, in press order, when another key goes down. */
+static void
+resolve_pending(unsigned short except)
+{
+    unsigned long long first;
+    int k, pick;
+
+    while (npending > (except && duals[except] &&
+        duals[except]->state == DUAL_PENDING)) {
+        pick = -1;
+        first = 0;
+        for (k = 0; k < KEY_CNT; k++)
+            if (k != except && duals[k] && duals[k]->state == DUAL_PENDING &&
+                (pick < 0 || duals[k]->timer.deadline < first)) {
+                pick = k;
+                first = duals[k]->timer.deadline;
+            }
+        resolve_hold(pick);
+    }
+}
+
+/* Expire every deadline up to stamp (us), oldest first. */
+static void
+expire(unsigned long long stamp)
+{
+    unsigned long long ms;
+    Timer *t, *next;
+
+    for (ms = wheel_ms; ms <= stamp / 1000 && ms < wheel_ms + WHEEL_SLOTS; ms++) {
+        for (t = wheel[ms % WHEEL_SLOTS]; t; t = next) {
+            next = t->next;
+            if (t->deadline <= stamp)
+                resolve_hold(t->key);
+        }
+    }
+    if (stamp / 1000 > wheel_ms)
+        wheel_ms = stamp / 1000;
+}
+
+static void
+key_event(const struct input_event *ev)
+{
+    unsigned long long stamp = event_usec(ev);
+    unsigned short code = ev->code, out;
+    Dual *d = duals[code];
+
+    expire(stamp);
+
+    if (d && ev->value == 1) {
+        resolve_pending(code);
+        d->state = DUAL_PENDING;
+        npending++;
+        d->timer.key = code;
+        timer_add(&d->timer, stamp + term);
+        return;
+    }
+    if (d && ev->value == 0 && d->state != DUAL_NONE) {
+        if (d->state == DUAL_PENDING) {
+            // released within the term: tap
+            timer_del(&d->timer);
+            npending--;
+            // clients that sample the state at SYN_REPORT would miss it
+            emit(EV_KEY, d->tap, 1);
+            flush_frame();
+            emit(EV_KEY, d->tap, 0);
+        } else if (d->layer) {
+            layers &= ~(1U << d->layer);
+        } else {
+            emit(EV_KEY, active[code], 0);
+            active[code] = 0;
+        }
+        d->state = DUAL_NONE;
+        return;
+    }
+    if (d && ev->value == 2) {
+        if (d->state == DUAL_HOLD && active[code])
+            emit(EV_KEY, active[code], 2);
+        return;
+    }
+
+    if (ev->value == 1) {
+        resolve_pending(0);
+        out = lookup(code);
+        active[code] = out;
+        emit(EV_KEY, out, 1);
+    } else if (active[code]) {
+        // the key pressed, whatever the layers are now
+        emit(EV_KEY, active[code], ev->value);
+        if (ev->value == 0)
+            active[code] = 0;
+    }
+}
+
+/*
+ * After SYN_DROPPED: release what the device no longer reports as down,
+ * as if the releases had come with the SYN_REPORT that ends the gap.
+ */
+static void
+resync(const struct input_event *syn)
+{
+    unsigned char keys[KEY_MAX / 8 + 1];
+    struct input_event ev = *syn;
+    int k;
+
+    memset(keys, 0, sizeof(keys));
+    ioctl(dev, EVIOCGKEY(sizeof(keys)), keys);
+    ev.type = EV_KEY;
+    ev.value = 0;
+    for (k = 0; k < KEY_CNT; k++)
+        if ((active[k] || (duals[k] && duals[k]->state != DUAL_NONE)) &&
+            !(keys[k / 8] & 1 << (k % 8))) {
+            ev.code = k;
+            key_event(&ev);
+        }
+}
+
+static int
+read_device(void)
+{
+    static int dropped;     // SYN_DROPPED seen, resync at SYN_REPORT
+    struct input_event ev[64];
+    ssize_t rd;
+    int i;
+
+    while ((rd = read(dev, ev, sizeof(ev))) > 0) {
+        for (i = 0; i < rd / (ssize_t)sizeof(*ev); i++) {
+            if (ev[i].type == EV_SYN && ev[i].code == SYN_DROPPED) {
+                dropped = 1;
+            } else if (ev[i].type == EV_SYN && ev[i].code == SYN_REPORT) {
+                if (dropped)
+                    resync(&ev[i]);
+                dropped = 0;
+                flush_frame();
+            } else if (!dropped && ev[i].type == EV_KEY && ev[i].code < KEY_CNT) {
+                key_event(&ev[i]);
+            }
+        }
+    }
+    if (rd < 0 && errno == EAGAIN)
+        return 0;
+    if (rd < 0)
+        perror("evtaphold: error reading");
+    else
+        fprintf(stderr, "evtaphold: device gone\n");
+    return -1;
+}
+
+static void
+release_all(void)
+{
+    int k;
+
+    for (k = 0; k < KEY_CNT; k++)
+        if (active[k])
+            emit(EV_KEY, active[k], 0);
+    flush_frame();
+}
+
+int main(int argc, char **argv)
+{
+    const char *name = "evtaphold", *path = NULL;
+    struct epoll_event ee, events[4];
+    unsigned long long expirations;
+    unsigned ms;
+    sigset_t sigs;
+    int opt, ep, sfd, i, n, run = 1;
+
+    while ((opt = getopt(argc, argv, "d:t:k:l:n:h")) >= 0) {
+        switch (opt) {
+            case 'd':
+                path = optarg;
+                break;
+
+            case 't':
+                if (sscanf(optarg, "%u", &ms) != 1 || ms == 0 || ms > TERM_MAX_MS)
+                    usage(1);
+                term = ms * 1000ULL;
+                break;
+
+            case 'k':
+                add_dual(optarg);
+                break;
+
+            case 'l':
+                add_layer_map(optarg);
+                break;
+
+            case 'n':
+                name = optarg;
+                break;
+
+            case 'h':
+                usage(0);
+                exit(0);
+
+            default:
+                usage(1);
+        }
+    }
+    if (optind < argc || path == NULL)
+        usage(1);
+
+    dev = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (dev < 0) {
+        perror(path);
+        exit(1);
+    }
+    use_monotonic_stamps(dev);
+
+    frame.fd = uinput_open();
+    if (frame.fd < 0)
+        exit(1);
+    uinput_set_keyboard_keys(frame.fd);
+    uinput_set_leds(frame.fd);
+    if (uinput_create(frame.fd, name, 0x4576, 0x7468) < 0)
+        exit(1);
+
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    wheel_ms = now_usec() / 1000;
+
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    sigprocmask(SIG_BLOCK, &sigs, NULL);
+    sfd = signalfd(-1, &sigs, SFD_CLOEXEC);
+
+    ep = epoll_create1(EPOLL_CLOEXEC);
+    ee.events = EPOLLIN;
+    ee.data.fd = dev;
+    epoll_ctl(ep, EPOLL_CTL_ADD, dev, &ee);
+    ee.data.fd = frame.fd;
+    epoll_ctl(ep, EPOLL_CTL_ADD, frame.fd, &ee);
+    ee.data.fd = tfd;
+    epoll_ctl(ep, EPOLL_CTL_ADD, tfd, &ee);
+    ee.data.fd = sfd;
+    epoll_ctl(ep, EPOLL_CTL_ADD, sfd, &ee);
+
+    if (ioctl(dev, EVIOCGRAB, 1) < 0) {
+        perror(path);
+        exit(1);
+    }
+
+    while (run) {
+        n = epoll_wait(ep, events, 4, -1);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.fd == dev) {
+                if (read_device() < 0)
+                    run = 0;
+            } else if (events[i].data.fd == tfd) {
+                if (read(tfd, &expirations, sizeof(expirations)) < 0)
+                    continue;
+                // events stamped before the deadline may still be queued
+                if (read_device() < 0)
+                    run = 0;
+                expire(now_usec());
+                flush_frame();
+            } else if (events[i].data.fd == frame.fd) {
+                // LED changes go back to the keyboard
+                uinput_forward_leds(frame.fd, &dev, 1);
+            } else {
+                run = 0;
+            }
+        }
+        timer_arm();
+    }
+
+    release_all();
+    ioctl(dev, EVIOCGRAB, 0);
+    ioctl(frame.fd, UI_DEV_DESTROY);
+    return 0;
+}
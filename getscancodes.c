@@ -26,37 +26,1120 @@ Date of last change: 3-Sept-2005
 #include <stdint.h>
 
 #include <linux/input.h>
+#include <linux/hidraw.h>
 
 #include <string.h>
+#include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <errno.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stddef.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <linux/io_uring.h>
+#include <linux/swab.h>
+#include <endian.h>
 
 #ifndef EV_SYN
 #define EV_SYN 0
 #endif
 
+/*
+ * hidraw mode: for keys hid-input drops before evdev, so no MSC_SCAN.
+ * The report descriptor is compiled once into a table of input fields
+ * sorted by report ID; each report then only extracts and compares the
+ * fields of its own ID. The usage printed is page << 16 | id, the
+ * scancode hid-input would report and evmap takes.
+ */
+#define FIELD_ARRAY	1
+#define FIELD_SIGNED	2
+
+struct hid_field {
+	uint32_t bitpos;	/* after the report ID byte */
+	uint8_t size;		/* bits, 1..32 */
+	uint8_t flags;
+	uint8_t report_id;
+	uint16_t count;		/* slots of an array field */
+	uint32_t usage;		/* variable: the usage; array: index in usages */
+	uint32_t nusages;	/* array: usages indexed by value - lmin */
+	int32_t lmin;
+	uint32_t last;		/* variable: last value; array: index in slots */
+};
+
+static struct hid_field *fields;
+static unsigned nfields;
+static uint32_t *usages, *slots, *slots_new;
+static unsigned nusages, nslots;
+static unsigned report_first[257];	/* fields of ID i: [first[i], first[i + 1]) */
+static int has_report_ids;
+
+/* room for element n of an array doubled at powers of two */
+static void *grow(void *p, unsigned n, size_t size)
+{
+	if (n & (n - 1) || (p = realloc(p, (n ? 2 * n : 1) * size)))
+		return p;
+	perror("getscancodes");
+	exit(1);
+}
+
+static int field_cmp(const void *a, const void *b)
+{
+	const struct hid_field *x = a, *y = b;
+
+	if (x->report_id != y->report_id)
+		return x->report_id - y->report_id;
+	return x->bitpos < y->bitpos ? -1 : x->bitpos > y->bitpos;
+}
+
+#define LOCAL_USAGES 4096
+
+static int hid_compile(const uint8_t *d, unsigned len)
+{
+	struct { uint32_t page, size, count, id; int32_t lmin; } g = { 0 }, stack[8];
+	unsigned sp = 0, nlocal = 0, size, i;
+	uint32_t local[LOCAL_USAGES], umin = 0, bitoff[256] = { 0 };
+	const uint8_t *p, *end = d + len;
+
+	for (p = d; p < end; p += 1 + size) {
+		uint32_t val = 0;
+		int32_t sval;
+
+		if (p[0] == 0xfe) {	/* long item, nothing we need */
+			if (p + 2 > end)
+				return -1;
+			size = 2 + p[1];
+			continue;
+		}
+		size = (p[0] & 3) == 3 ? 4 : p[0] & 3;
+		if (p + 1 + size > end)
+			return -1;
+		for (i = 0; i < size; i++)
+			val |= (uint32_t) p[1 + i] << 8 * i;
+		sval = size == 1 ? (int8_t) val : size == 2 ? (int16_t) val : (int32_t) val;
+
+		switch (p[0] & 0xfc) {
+		case 0x04: g.page = val; break;
+		case 0x14: g.lmin = sval; break;
+		case 0x74: g.size = val; break;
+		case 0x84: g.id = val & 0xff; has_report_ids = 1; break;
+		case 0x94: g.count = val; break;
+		case 0xa4:
+			if (sp == sizeof(stack) / sizeof(*stack))
+				return -1;
+			stack[sp++] = g;
+			break;
+		case 0xb4:
+			if (sp == 0)
+				return -1;
+			g = stack[--sp];
+			break;
+
+		case 0x08:	/* Usage */
+			if (nlocal < LOCAL_USAGES)
+				local[nlocal++] = size == 4 ? val : g.page << 16 | val;
+			break;
+		case 0x18:	/* Usage Minimum */
+			umin = size == 4 ? val : g.page << 16 | val;
+			break;
+		case 0x28:	/* Usage Maximum */
+			val = size == 4 ? val : g.page << 16 | val;
+			for (; umin <= val && nlocal < LOCAL_USAGES; umin++)
+				local[nlocal++] = umin;
+			break;
+
+		case 0x80:	/* Input */
+			if (g.size < 1 || g.size > 32 || g.count == 0) {
+				/* nothing to extract */
+			} else if (val & 1) {
+				/* constant, padding */
+			} else if (val & 2) {
+				for (i = 0; i < g.count; i++) {
+					fields = grow(fields, nfields, sizeof(*fields));
+					fields[nfields++] = (struct hid_field) {
+						.bitpos = bitoff[g.id] + i * g.size,
+						.size = g.size,
+						.flags = g.lmin < 0 ? FIELD_SIGNED : 0,
+						.report_id = g.id,
+						.usage = nlocal ? local[i < nlocal ? i : nlocal - 1] : 0,
+						.lmin = g.lmin,
+					};
+				}
+			} else if (g.count <= 0xffff) {
+				fields = grow(fields, nfields, sizeof(*fields));
+				fields[nfields++] = (struct hid_field) {
+					.bitpos = bitoff[g.id],
+					.size = g.size,
+					.flags = FIELD_ARRAY | (g.lmin < 0 ? FIELD_SIGNED : 0),
+					.report_id = g.id,
+					.count = g.count,
+					.usage = nusages,
+					.nusages = nlocal,
+					.lmin = g.lmin,
+					.last = nslots,
+				};
+				for (i = 0; i < nlocal; i++) {
+					usages = grow(usages, nusages, sizeof(*usages));
+					usages[nusages++] = local[i];
+				}
+				nslots += g.count;
+			}
+			bitoff[g.id] += g.size * g.count;
+			/* Main items clear the locals */
+			/* fall through */
+		case 0x90: case 0xa0: case 0xb0: case 0xc0:
+			nlocal = 0;
+			umin = 0;
+			break;
+		}
+	}
+
+	slots = calloc(nslots + 1, sizeof(*slots));
+	slots_new = calloc(nslots + 1, sizeof(*slots_new));
+	if (!slots || !slots_new)
+		return -1;
+	qsort(fields, nfields, sizeof(*fields), field_cmp);
+	for (i = 0; i < 257; i++)
+		report_first[i] = nfields;
+	for (i = nfields; i-- > 0; )
+		report_first[fields[i].report_id] = i;
+	for (i = 256; i-- > 0; )
+		if (report_first[i] > report_first[i + 1])
+			report_first[i] = report_first[i + 1];
+	return 0;
+}
+
+static uint32_t get_bits(const uint8_t *buf, unsigned len, uint32_t pos, unsigned size,
+			 int sign)
+{
+	uint64_t v = 0;
+	unsigned byte = pos / 8, n = (pos % 8 + size + 7) / 8, i;
+
+	for (i = 0; i < n && byte + i < len; i++)
+		v |= (uint64_t) buf[byte + i] << 8 * i;
+	v >>= pos % 8;
+	if (size < 32) {
+		v &= (1U << size) - 1;
+		if (sign && v >> (size - 1))
+			v |= ~0ULL << size;
+	}
+	return v;
+}
+
+static void print_usage(uint32_t usage, int32_t value)
+{
+	printf("usage %x:%04x scancode 0x%x value %d\n",
+	    usage >> 16, usage & 0xffff, usage, value);
+}
+
+/* usage of an array slot value, 0 for none or out of range */
+static uint32_t array_usage(const struct hid_field *f, uint32_t value)
+{
+	uint32_t idx = value - f->lmin;
+
+	if (idx >= f->nusages || (usages[f->usage + idx] & 0xffff) == 0)
+		return 0;
+	return usages[f->usage + idx];
+}
+
+static int array_has(const uint32_t *s, unsigned n, uint32_t usage)
+{
+	while (n--)
+		if (s[n] == usage)
+			return 1;
+	return 0;
+}
+
+static void hid_report(const uint8_t *buf, unsigned len)
+{
+	unsigned id = 0, i, j;
+
+	if (has_report_ids) {
+		if (len == 0)
+			return;
+		id = *buf++;
+		len--;
+	}
+	for (i = report_first[id]; i < report_first[id + 1]; i++) {
+		struct hid_field *f = &fields[i];
+		int sign = f->flags & FIELD_SIGNED;
+
+		if (!(f->flags & FIELD_ARRAY)) {
+			uint32_t v = get_bits(buf, len, f->bitpos, f->size, sign);
+
+			if (v != f->last) {
+				f->last = v;
+				print_usage(f->usage, v);
+			}
+			continue;
+		}
+
+		uint32_t *old = &slots[f->last], *new = &slots_new[f->last];
+
+		for (j = 0; j < f->count; j++)
+			new[j] = array_usage(f, get_bits(buf, len, f->bitpos + j * f->size,
+							 f->size, sign));
+		for (j = 0; j < f->count; j++)
+			if (old[j] && !array_has(new, f->count, old[j]))
+				print_usage(old[j], 0);
+		for (j = 0; j < f->count; j++)
+			if (new[j] && !array_has(old, f->count, new[j]))
+				print_usage(new[j], 1);
+		memcpy(old, new, f->count * sizeof(*old));
+	}
+	fflush(stdout);
+}
+
+static int hidraw_main(const char *path)
+{
+	int fd, rd;
+	struct hidraw_report_descriptor desc;
+	struct hidraw_devinfo info;
+	char name[256] = "Unknown";
+	uint8_t buf[4096];
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+	{
+		perror("getscancodes");
+		return 1;
+	}
+
+	if (ioctl(fd, HIDIOCGRDESCSIZE, &desc.size) < 0 ||
+	    ioctl(fd, HIDIOCGRDESC, &desc) < 0)
+	{
+		perror("getscancodes: can't get report descriptor");
+		return 1;
+	}
+
+	if (ioctl(fd, HIDIOCGRAWINFO, &info) == 0)
+		printf("HID device ID: bus 0x%x vendor 0x%x product 0x%x\n",
+		    info.bustype, (unsigned short) info.vendor,
+		    (unsigned short) info.product);
+
+	ioctl(fd, HIDIOCGRAWNAME(sizeof(name)), name);
+	printf("HID device name: \"%s\"\n", name);
+
+	if (hid_compile(desc.value, desc.size) < 0)
+	{
+		fprintf(stderr, "getscancodes: bad report descriptor\n");
+		return 1;
+	}
+	printf("Report descriptor: %u bytes, %u input fields%s\n",
+	    desc.size, nfields, has_report_ids ? ", report IDs" : "");
+
+	while (1) {
+		rd = read(fd, buf, sizeof(buf));
+
+		if (rd < 0) {
+			perror("getscancodes: error reading");
+			return 1;
+		}
+
+		hid_report(buf, rd);
+	}
+}
+
+/*
+ * Metrics mode: counters for several event devices in one fixed-size
+ * shared block, updated from the event batches already read, so no
+ * syscall per event. They are served as Prometheus text to whoever
+ * connects to the Unix socket and/or written to a textfile collector
+ * path (temp file + rename) every interval.
+ */
+#define METRICS_DEVICES	128
+#define METRICS_MAGIC	"getscancodes 1"
+
+struct dev_metrics {
+	char path[64];
+	char name[128];
+	uint64_t up;
+	uint64_t events, reports, syn_dropped;
+	uint64_t key_presses, key_chatter;
+	uint64_t last_event;	/* event time, seconds */
+};
+
+struct metrics_block {
+	char magic[16];
+	uint32_t ndevices;
+	uint32_t chatter_ms;
+	struct dev_metrics dev[METRICS_DEVICES];
+};
+
+static const struct {
+	const char *name, *type, *help;
+	size_t off;
+} metric_list[] = {
+	{ "up", "gauge", "Device is open.",
+	  offsetof(struct dev_metrics, up) },
+	{ "events_total", "counter", "Input events read.",
+	  offsetof(struct dev_metrics, events) },
+	{ "reports_total", "counter", "SYN_REPORT frames read.",
+	  offsetof(struct dev_metrics, reports) },
+	{ "syn_dropped_total", "counter", "SYN_DROPPED, events lost in the kernel buffer.",
+	  offsetof(struct dev_metrics, syn_dropped) },
+	{ "key_presses_total", "counter", "Key presses.",
+	  offsetof(struct dev_metrics, key_presses) },
+	{ "key_chatter_total", "counter", "Key presses closer than the chatter time to the release of the same key.",
+	  offsetof(struct dev_metrics, key_chatter) },
+	{ "last_event_timestamp_seconds", "gauge", "Time of the last event read.",
+	  offsetof(struct dev_metrics, last_event) },
+};
+
+static struct metrics_block *metrics;
+
+static struct metrics_block *metrics_map(const char *shm)
+{
+	void *p;
+	int fd = -1;
+
+	if (shm) {
+		if ((fd = shm_open(shm, O_RDWR | O_CREAT, 0644)) < 0 ||
+		    ftruncate(fd, sizeof(*metrics)) < 0) {
+			perror(shm);
+			return NULL;
+		}
+	}
+	p = mmap(NULL, sizeof(*metrics), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | (fd < 0 ? MAP_ANONYMOUS : 0), fd, 0);
+	if (fd >= 0)
+		close(fd);
+	if (p == MAP_FAILED) {
+		perror("getscancodes: mmap");
+		return NULL;
+	}
+	memset(p, 0, sizeof(*metrics));
+	return p;
+}
+
+static void metrics_count(struct dev_metrics *m, uint64_t *released,
+			  const struct input_event *ev, unsigned n)
+{
+	uint64_t t, chatter = metrics->chatter_ms * 1000ULL;
+
+	for (unsigned i = 0; i < n; i++) {
+		switch (ev[i].type) {
+		case EV_SYN:
+			if (ev[i].code == SYN_REPORT)
+				m->reports++;
+			else if (ev[i].code == SYN_DROPPED)
+				m->syn_dropped++;
+			break;
+		case EV_KEY:
+			if (ev[i].code >= KEY_CNT)
+				break;
+			t = ev[i].input_event_sec * 1000000ULL + ev[i].input_event_usec;
+			if (ev[i].value == 1) {
+				m->key_presses++;
+				if (t - released[ev[i].code] < chatter)
+					m->key_chatter++;
+			} else if (ev[i].value == 0) {
+				released[ev[i].code] = t;
+			}
+			break;
+		}
+	}
+	m->events += n;
+	if (n)
+		m->last_event = ev[n - 1].input_event_sec;
+}
+
+static void label(FILE *f, const char *s)
+{
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fputc('\\', f);
+		if (*s == '\n')
+			fputs("\\n", f);
+		else
+			fputc(*s, f);
+	}
+}
+
+/* Prometheus text of the whole block, free() the result */
+static char *metrics_render(size_t *len)
+{
+	char *buf = NULL;
+	FILE *f = open_memstream(&buf, len);
+
+	if (!f)
+		return NULL;
+	for (unsigned i = 0; i < sizeof(metric_list) / sizeof(*metric_list); i++) {
+		fprintf(f, "# HELP getscancodes_%s %s\n# TYPE getscancodes_%s %s\n",
+		    metric_list[i].name, metric_list[i].help,
+		    metric_list[i].name, metric_list[i].type);
+		for (unsigned d = 0; d < metrics->ndevices; d++) {
+			struct dev_metrics *m = &metrics->dev[d];
+
+			fprintf(f, "getscancodes_%s{device=\"", metric_list[i].name);
+			label(f, m->path);
+			fprintf(f, "\",name=\"");
+			label(f, m->name);
+			fprintf(f, "\"} %llu\n", (unsigned long long)
+			    *(uint64_t *) ((char *) m + metric_list[i].off));
+		}
+	}
+	if (fclose(f))
+		return NULL;
+	return buf;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	for (; len; buf += n, len -= n)
+		if ((n = write(fd, buf, len)) < 0)
+			return -1;
+	return 0;
+}
+
+static void metrics_serve(int fd)
+{
+	size_t len;
+	char *buf = metrics_render(&len);
+
+	if (buf && write_all(fd, buf, len) < 0)
+		perror("getscancodes: metrics");
+	free(buf);
+}
+
+static void metrics_write_file(const char *path)
+{
+	char tmp[4096];
+	int fd;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+		perror(tmp);
+		return;
+	}
+	metrics_serve(fd);
+	if (close(fd) < 0 || rename(tmp, path) < 0)
+		perror(path);
+}
+
+static int metrics_listen(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "getscancodes: %s: path too long\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+	    bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+	    listen(fd, 8) < 0) {
+		perror(path);
+		return -1;
+	}
+	return fd;
+}
+
+static uint64_t monotonic_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* capture state shared by the poll() and io_uring loops */
+static struct {
+	char **paths;
+	unsigned n;
+	int *fd;
+	struct input_event (*buf)[256];
+	uint64_t (*released)[KEY_CNT];
+	int sock;
+	const char *file;
+	unsigned interval;
+	uint64_t next_write, end;	/* monotonic ms, end 0 for none */
+	uint64_t syscalls;
+} cap;
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void) sig;
+	stop = 1;
+}
+
+static void capture_gone(unsigned i, int err)
+{
+	fprintf(stderr, "getscancodes: %s: %s\n", cap.paths[i],
+	    err ? strerror(err) : "end of file");
+	close(cap.fd[i]);
+	cap.fd[i] = -1;
+	metrics->dev[i].up = 0;
+}
+
+/* a client that does not read stalls capture for 100 ms per write at most */
+static void capture_accept(void)
+{
+	struct timeval tv = { 0, 100000 };
+	int fd = accept4(cap.sock, NULL, NULL, SOCK_CLOEXEC);
+
+	if (fd >= 0) {
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		metrics_serve(fd);
+		close(fd);
+	}
+}
+
+/* writes the textfile when due; ms to the next deadline, -1 for none */
+static int capture_timeout(void)
+{
+	uint64_t now = monotonic_ms(), next = UINT64_MAX;
+
+	if (cap.end) {
+		if (now >= cap.end) {
+			stop = 1;
+			return 0;
+		}
+		next = cap.end;
+	}
+	if (cap.file) {
+		if (now >= cap.next_write) {
+			metrics_write_file(cap.file);
+			cap.next_write = now + cap.interval * 1000ULL;
+		}
+		if (cap.next_write < next)
+			next = cap.next_write;
+	}
+	return next == UINT64_MAX ? -1 : (int) (next - now);
+}
+
+static int capture_poll(void)
+{
+	struct pollfd pfd[METRICS_DEVICES + 1];
+	unsigned i, n = cap.n;
+	int rd, timeout;
+
+	for (i = 0; i < n; i++) {
+		pfd[i].fd = cap.fd[i];
+		pfd[i].events = POLLIN;
+	}
+	pfd[n].fd = cap.sock;
+	pfd[n].events = POLLIN;
+
+	while ((timeout = capture_timeout()), !stop) {
+		cap.syscalls++;
+		if (poll(pfd, n + 1, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("getscancodes: poll");
+			return 1;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (!pfd[i].revents)
+				continue;
+			/* a short read means the buffer is empty, no read for EAGAIN */
+			do {
+				cap.syscalls++;
+				rd = read(pfd[i].fd, cap.buf[i], sizeof(*cap.buf));
+				if (rd > 0)
+					metrics_count(&metrics->dev[i], cap.released[i],
+					    cap.buf[i], rd / sizeof(**cap.buf));
+			} while (rd == sizeof(*cap.buf));
+			if (rd == 0 || (rd < 0 && errno != EAGAIN)) {
+				capture_gone(i, rd ? errno : 0);
+				pfd[i].fd = -1;
+			}
+		}
+
+		if (pfd[n].revents & POLLIN)
+			capture_accept();
+	}
+	return 0;
+}
+
+/*
+ * io_uring loop, raw syscalls: the device fds and their buffers are
+ * registered, a READ_FIXED per device is kept posted and re-armed from
+ * its completion, the socket and the timer are a POLL_ADD and a TIMEOUT.
+ * One io_uring_enter both submits the re-arms and waits, and every
+ * completion already in the ring is reaped before the next one.
+ * Devices are opened blocking: io_uring polls them itself and reads
+ * once they are ready.
+ */
+#define UD_SOCK		(~0ULL)
+#define UD_TIMER	(~0ULL - 1)
+
+static struct {
+	int fd;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned tail, queued;
+} ring;
+
+static int uring_setup(unsigned entries)
+{
+	struct io_uring_params p;
+	size_t sq_size, cq_size;
+	char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	if ((ring.fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+		return -1;
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP && cq_size > sq_size)
+		sq_size = cq_size;
+	sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	    ring.fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		return -1;
+	cq = sq;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		    ring.fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			return -1;
+	}
+	ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+		return -1;
+
+	ring.sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	ring.sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *) (sq + p.sq_off.array);
+	ring.cq_head = (unsigned *) (cq + p.cq_off.head);
+	ring.cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	ring.cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	ring.tail = *ring.sq_tail;
+	return 0;
+}
+
+static struct io_uring_sqe *uring_sqe(uint8_t op, uint64_t data)
+{
+	unsigned idx = ring.tail & *ring.sq_mask;
+	struct io_uring_sqe *sqe = &ring.sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->user_data = data;
+	ring.sq_array[idx] = idx;
+	ring.tail++;
+	ring.queued++;
+	return sqe;
+}
+
+/* the kernel sees the queued entries once the tail is stored */
+static void uring_flush(void)
+{
+	__atomic_store_n(ring.sq_tail, ring.tail, __ATOMIC_RELEASE);
+}
+
+static void uring_read(unsigned i)
+{
+	struct io_uring_sqe *sqe = uring_sqe(IORING_OP_READ_FIXED, i);
+
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = i;
+	sqe->addr = (uintptr_t) cap.buf[i];
+	sqe->len = sizeof(*cap.buf);
+	sqe->buf_index = i;
+}
+
+static void uring_timer(int ms)
+{
+	static struct __kernel_timespec ts;
+	struct io_uring_sqe *sqe;
+
+	if (ms < 0)
+		return;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = ms % 1000 * 1000000L;
+	sqe = uring_sqe(IORING_OP_TIMEOUT, UD_TIMER);
+	sqe->addr = (uintptr_t) &ts;
+	sqe->len = 1;
+}
+
+static void uring_poll_sock(void)
+{
+	struct io_uring_sqe *sqe = uring_sqe(IORING_OP_POLL_ADD, UD_SOCK);
+
+	sqe->fd = cap.sock;
+	/* the kernel reads the two 16-bit halves swapped on big-endian, as liburing does */
+#if __BYTE_ORDER == __BIG_ENDIAN
+	sqe->poll32_events = __swahw32(POLLIN);
+#else
+	sqe->poll32_events = POLLIN;
+#endif
+}
+
+static int capture_uring(void)
+{
+	struct iovec *iov = calloc(cap.n, sizeof(*iov));
+	unsigned i, head, tail;
+	int ret;
+
+	if (!iov || uring_setup(cap.n + 2) < 0) {
+		perror("getscancodes: io_uring");
+		return 1;
+	}
+	for (i = 0; i < cap.n; i++) {
+		iov[i].iov_base = cap.buf[i];
+		iov[i].iov_len = sizeof(*cap.buf);
+	}
+	if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, cap.fd, cap.n) < 0 ||
+	    syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iov, cap.n) < 0) {
+		perror("getscancodes: io_uring_register");
+		return 1;
+	}
+	free(iov);
+
+	for (i = 0; i < cap.n; i++)
+		uring_read(i);
+	if (cap.sock >= 0)
+		uring_poll_sock();
+	uring_timer(capture_timeout());
+
+	while (!stop) {
+		uring_flush();
+		cap.syscalls++;
+		ret = syscall(__NR_io_uring_enter, ring.fd, ring.queued, 1,
+		    IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("getscancodes: io_uring_enter");
+			return 1;
+		}
+		ring.queued -= ret;
+
+		head = *ring.cq_head;
+		tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+			int res = cqe->res;
+
+			if (cqe->user_data == UD_SOCK) {
+				capture_accept();
+				uring_poll_sock();
+			} else if (cqe->user_data == UD_TIMER) {
+				uring_timer(capture_timeout());
+			} else if (res > 0) {
+				i = cqe->user_data;
+				metrics_count(&metrics->dev[i], cap.released[i], cap.buf[i],
+				    res / sizeof(**cap.buf));
+				uring_read(i);
+			} else if (res == -EAGAIN || res == -EINTR) {
+				uring_read(cqe->user_data);
+			} else {
+				capture_gone(cqe->user_data, -res);
+			}
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+static int capture_main(const char *sock, const char *shm, unsigned chatter_ms,
+			unsigned duration, int use_uring)
+{
+	struct sigaction sa = { .sa_handler = on_signal };
+	struct rusage ru;
+	uint64_t start, events = 0;
+	double secs;
+	unsigned i;
+	int ret;
+
+	if (cap.n > METRICS_DEVICES) {
+		fprintf(stderr, "getscancodes: at most %d devices\n", METRICS_DEVICES);
+		return 1;
+	}
+	cap.fd = calloc(cap.n, sizeof(*cap.fd));
+	cap.buf = calloc(cap.n, sizeof(*cap.buf));
+	cap.released = calloc(cap.n, sizeof(*cap.released));
+	if (!(metrics = metrics_map(shm)) || !cap.fd || !cap.buf || !cap.released) {
+		perror("getscancodes");
+		return 1;
+	}
+	strcpy(metrics->magic, METRICS_MAGIC);
+	metrics->ndevices = cap.n;
+	metrics->chatter_ms = chatter_ms;
+
+	for (i = 0; i < cap.n; i++) {
+		struct dev_metrics *m = &metrics->dev[i];
+
+		snprintf(m->path, sizeof(m->path), "%s", cap.paths[i]);
+		cap.fd[i] = open(cap.paths[i],
+		    O_RDONLY | O_CLOEXEC | (use_uring ? 0 : O_NONBLOCK));
+		if (cap.fd[i] < 0) {
+			perror(cap.paths[i]);
+			return 1;
+		}
+		ioctl(cap.fd[i], EVIOCGNAME(sizeof(m->name) - 1), m->name);
+		m->up = 1;
+	}
+	if ((cap.sock = sock ? metrics_listen(sock) : -1) < 0 && sock)
+		return 1;
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	start = monotonic_ms();
+	cap.next_write = start;
+	if (duration)
+		cap.end = start + duration * 1000ULL;
+
+	ret = use_uring ? capture_uring() : capture_poll();
+	if (cap.file)
+		metrics_write_file(cap.file);
+
+	secs = (monotonic_ms() - start) / 1000.0;
+	for (i = 0; i < cap.n; i++)
+		events += metrics->dev[i].events;
+	/* RUSAGE_SELF includes the io-wq worker threads doing the reads */
+	getrusage(RUSAGE_SELF, &ru);
+	fprintf(stderr, "getscancodes: %s: %llu events in %.3f s, %.0f/s, %llu syscalls, "
+	    "%.1f events/syscall, cpu %.3f s\n", use_uring ? "io_uring" : "poll",
+	    (unsigned long long) events, secs, secs > 0 ? events / secs : 0,
+	    (unsigned long long) cap.syscalls,
+	    cap.syscalls ? (double) events / cap.syscalls : 0,
+	    ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+	    (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6);
+	return ret;
+}
+
+/*
+ * --follow: the device is known by its EVIOCGID, name and phys. A watch
+ * on /dev/input is set up before the capture starts; when the device
+ * goes away, only the nodes created (or chmod'ed by udev, if the first
+ * open was refused) since then are opened and compared. /dev/input is
+ * only scanned if the inotify queue overflowed and events were lost.
+ */
+struct dev_ident {
+	struct input_id id;
+	char name[256];
+	char phys[256];
+};
+
+static int get_ident(int fd, struct dev_ident *d)
+{
+	memset(d, 0, sizeof(*d));
+	if (ioctl(fd, EVIOCGID, &d->id) < 0)
+		return -1;
+	ioctl(fd, EVIOCGNAME(sizeof(d->name) - 1), d->name);
+	ioctl(fd, EVIOCGPHYS(sizeof(d->phys) - 1), d->phys);
+	return 0;
+}
+
+static int follow_open(const char *name, const struct dev_ident *want,
+		       char *path, size_t size)
+{
+	struct dev_ident got;
+	int fd;
+
+	if (strncmp(name, "event", 5))
+		return -1;
+	snprintf(path, size, "/dev/input/%s", name);
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	if (get_ident(fd, &got) == 0 && !memcmp(&got, want, sizeof(got)))
+		return fd;
+	close(fd);
+	return -1;
+}
+
+static int follow_scan(const struct dev_ident *want, char *path, size_t size)
+{
+	DIR *dir = opendir("/dev/input");
+	struct dirent *de;
+	int fd = -1;
+
+	if (!dir)
+		return -1;
+	while (fd < 0 && (de = readdir(dir)))
+		fd = follow_open(de->d_name, want, path, size);
+	closedir(dir);
+	return fd;
+}
+
+static int follow_wait(int ino, const struct dev_ident *want, char *path, size_t size)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ie;
+	ssize_t len;
+	int fd;
+
+	while (1) {
+		if ((len = read(ino, buf, sizeof(buf))) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		for (char *p = buf; p < buf + len; p += sizeof(*ie) + ie->len) {
+			ie = (const struct inotify_event *) p;
+			if (ie->mask & IN_Q_OVERFLOW)
+				fd = follow_scan(want, path, size);
+			else if (ie->len)
+				fd = follow_open(ie->name, want, path, size);
+			else
+				continue;
+			if (fd >= 0)
+				return fd;
+		}
+	}
+}
+
+static double realtime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 int main (int argc, char **argv)
 {
 	int fd, rd;
 	struct input_event ev[64];
-	int version;
+	int version, opt;
 	unsigned short id[4];
 	char name[256] = "Unknown";
+	const char *hidraw = NULL;
+	const char *metrics_socket = NULL, *metrics_file = NULL, *metrics_shm = NULL;
+	unsigned metrics_interval = 15, chatter_ms = 30, duration = 0;
+	int use_uring = 0, follow = 0, ino = -1, interval_set = 0, chatter_set = 0;
+	struct dev_ident ident;
+	char path[300];
+	double gone, back;
+	static const struct option options[] = {
+		{ "hidraw", required_argument, NULL, 'r' },
+		{ "metrics-socket", required_argument, NULL, 's' },
+		{ "metrics-file", required_argument, NULL, 'f' },
+		{ "metrics-interval", required_argument, NULL, 'i' },
+		{ "metrics-shm", required_argument, NULL, 'm' },
+		{ "chatter-ms", required_argument, NULL, 'c' },
+		{ "duration", required_argument, NULL, 'd' },
+		{ "io-uring", no_argument, NULL, 'u' },
+		{ "follow", no_argument, NULL, 'F' },
+		{ 0 }
+	};
+
+	while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1)
+	{
+		switch (opt) {
+		case 'r':
+			hidraw = optarg;
+			break;
+		case 's':
+			metrics_socket = optarg;
+			break;
+		case 'f':
+			metrics_file = optarg;
+			break;
+		case 'i':
+			metrics_interval = strtoul(optarg, NULL, 0);
+			if (metrics_interval == 0)
+				metrics_interval = 1;
+			interval_set = 1;
+			break;
+		case 'm':
+			metrics_shm = optarg;
+			break;
+		case 'c':
+			chatter_ms = strtoul(optarg, NULL, 0);
+			chatter_set = 1;
+			break;
+		case 'd':
+			duration = strtoul(optarg, NULL, 0);
+			break;
+		case 'u':
+			use_uring = 1;
+			break;
+		case 'F':
+			follow = 1;
+			break;
+		default:
+			return 1;
+		}
+	}
 
-	if (argc < 2)
+	if (interval_set && !metrics_file)
+	{
+		fprintf(stderr, "getscancodes: --metrics-interval needs --metrics-file\n");
+		return 1;
+	}
+	if (chatter_set && !metrics_socket && !metrics_file && !metrics_shm)
 	{
-		printf("Usage: %s /dev/input/eventX\n", argv[0]);
+		fprintf(stderr, "getscancodes: --chatter-ms needs --metrics-socket, "
+		    "--metrics-file or --metrics-shm\n");
+		return 1;
+	}
+
+	if (hidraw)
+		return hidraw_main(hidraw);
+
+	if (optind >= argc)
+	{
+		printf("Usage: %s [--follow] /dev/input/eventX\n", argv[0]);
+		printf("       %s --hidraw /dev/hidrawX\n", argv[0]);
+		printf("       %s [--metrics-socket path] [--metrics-file path] [--metrics-interval s]\n"
+		       "           [--metrics-shm name] [--chatter-ms ms] [--duration s] [--io-uring]\n"
+		       "           /dev/input/eventX...\n", argv[0]);
 		printf("Where X = input device number\n");
 		return 1;
 	}
 
+	if (metrics_socket || metrics_file || metrics_shm || duration || use_uring)
+	{
+		cap.paths = argv + optind;
+		cap.n = argc - optind;
+		cap.file = metrics_file;
+		cap.interval = metrics_interval;
+		return capture_main(metrics_socket, metrics_shm, chatter_ms, duration,
+		    use_uring);
+	}
+
+	if (follow && (ino = inotify_init1(IN_CLOEXEC)) >= 0 &&
+	    inotify_add_watch(ino, "/dev/input", IN_CREATE | IN_ATTRIB) < 0)
+	{
+		close(ino);
+		ino = -1;
+	}
+	if (follow && ino < 0)
+	{
+		perror("getscancodes: inotify");
+		return 1;
+	}
+
 	if ((fd = open(argv[argc - 1], O_RDONLY)) < 0)
 	{
 		perror("getscancodes");
 		return 1;
 	}
 
+	if (follow && get_ident(fd, &ident) < 0)
+	{
+		perror("getscancodes: can't get device ID");
+		return 1;
+	}
+
 	if (ioctl(fd, EVIOCGVERSION, &version))
 	{
 		perror("getscancodes: can't get version");
@@ -76,6 +1159,23 @@ int main (int argc, char **argv)
 	while (1) {
 		rd = read(fd, ev, sizeof(struct input_event) * 64);
 
+		if (rd < (int) sizeof(struct input_event) && follow) {
+			gone = realtime();
+			printf("device gone at %.6f: %s\n", gone,
+			    rd < 0 ? strerror(errno) : rd ? "short read" : "end of file");
+			fflush(stdout);
+			close(fd);
+			if ((fd = follow_wait(ino, &ident, path, sizeof(path))) < 0) {
+				perror("getscancodes: inotify");
+				return 1;
+			}
+			back = realtime();
+			printf("device back at %.6f after %.3f s: %s\n",
+			    back, back - gone, path);
+			fflush(stdout);
+			continue;
+		}
+
 		if (rd < (int) sizeof(struct input_event)) {
 			perror("getscancodes: error reading");
 			return 1;
@@ -2,13 +2,31 @@
 
 #include <linux/kernel.h>
 #include <linux/module.h>
-#include <linux/kprobes.h>
+#include <linux/ftrace.h>
+#include <linux/version.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/rculist.h>
+#include <linux/slab.h>
+#include <linux/glob.h>
+#include <linux/kallsyms.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/moduleparam.h>
 
+#include <linux/hid.h>
 #include <linux/input.h>
 #include <linux/input/sparse-keymap.h>
 
+#include "sparse-keymap-all.h"
+
+#define SKC_READ_ONCE(x) READ_ONCE(x)
+#define SKC_SET_BIT(nr, addr) set_bit(nr, addr)
+#define SKC_CLEAR_BIT(nr, addr) clear_bit(nr, addr)
+#include "sparse-keymap-core.h"
+
 /*
- * This kprobe overrides the functions that get/set sparse
+ * This module overrides the functions that get/set sparse
  * keymap entry.
  * Example:
  *
@@ -96,28 +114,153 @@
  *  #
  */
 
+/*
+ * Per-device state is attached to each sparse keymap device as an input
+ * handle: it is created when the device shows up (or when the module is
+ * loaded), freed when the device goes away, and found from dev->h_list
+ * without a global table. It is only used under dev->event_lock, which
+ * the input core holds around getkeycode/setkeycode.
+ *
+ * core holds the scancode index and keycode counts (sparse-keymap-core.h).
+ * They live here rather than in the driver's key_entry array, and the
+ * index is rebuilt as soon as a set changes the scancode of an entry. The
+ * reporting path looks it up without event_lock, so changing entries,
+ * rebuilding it and
+ * swapping tables are done inside the seq write section and lockless
+ * readers retry.
+ *
+ * override is the entry of overrides[] the device was matched by. For
+ * devices without a key_entry table of their own (hid-input), shadow is
+ * one built by the override, which core indexes instead of dev->keycode,
+ * and usages[] are the driver's entries in the same order.
+ *
+ * allowed caches whether the device is in the devices= allowlist; it is
+ * decided in process context, on connect and when the list changes, and
+ * written under event_lock. The keymap and replace files refuse writes
+ * to devices not allowed.
+ *
+ * hits[] are per-CPU counters of reporting path lookups (key_entry
+ * overrides only, the others have no hooked reporting path), one per table
+ * entry plus one for scancodes not in the table, whose last values are
+ * kept in unknown[]. They are only ever incremented locklessly and summed
+ * when read.
+ *
+ * Each device also gets a debugfs directory, named after the input
+ * device (inputN), with the bulk keymap, replace and hits files. Each
+ * replace allocates a new key_entry array, with the same devres lifetime
+ * as the driver's own copy. Replaced arrays are never freed before the
+ * device is: drivers keep the entries sparse_keymap_entry_from_scancode()
+ * returns outside of any read section.
+ */
+struct sparse_keymap_all_override;
+
+struct sparse_keymap_all_dev {
+    struct input_handle handle;
+    struct list_head node;
+    struct dentry *debugfs;
+    const struct sparse_keymap_all_override *override;
+    struct key_entry *shadow;
+    struct hid_usage **usages;
+    bool allowed;
+    seqcount_t seq;
+    unsigned long __percpu *hits;
+    atomic_t unknown_next;
+    u32 unknown[8];
+    struct sparse_keymap_core core;
+};
+
+static struct input_handler sparse_keymap_all_handler;
+static LIST_HEAD(sparse_keymap_all_devs);
+static DEFINE_MUTEX(sparse_keymap_all_lock);
+static struct dentry *debugfs_dir;
+
+static struct sparse_keymap_all_dev *sparse_keymap_all_find(struct input_dev *dev)
+{
+    struct input_handle *handle;
+
+    list_for_each_entry_rcu(handle, &dev->h_list, d_node,
+                lockdep_is_held(&dev->event_lock))
+        if (handle->handler == &sparse_keymap_all_handler)
+            return container_of(handle, struct sparse_keymap_all_dev, handle);
+    return NULL;
+}
+
+static struct key_entry *sparse_keymap_all_keymap(struct sparse_keymap_all_dev *sd,
+                          struct input_dev *dev)
+{
+    return sd->shadow ? sd->shadow : dev->keycode;
+}
+
+// called with event_lock held, inside the seq write section
+static void __sparse_keymap_all_index_build(struct sparse_keymap_all_dev *sd,
+                        struct input_dev *dev)
+{
+    sparse_keymap_core_index_build(&sd->core, sparse_keymap_all_keymap(sd, dev));
+}
+
+static void sparse_keymap_all_counts_build(struct sparse_keymap_all_dev *sd,
+                       struct input_dev *dev)
+{
+    sparse_keymap_core_counts_build(&sd->core, sparse_keymap_all_keymap(sd, dev));
+}
+
+#ifdef DEBUG
+static void sparse_keymap_all_counts_check(struct sparse_keymap_all_dev *sd,
+                       struct input_dev *dev)
+{
+    int keycode = sparse_keymap_core_counts_check(&sd->core,
+                              sparse_keymap_all_keymap(sd, dev));
+
+    WARN_ONCE(keycode >= 0, "%s: keycode %#x miscounted\n",
+          dev_name(&dev->dev), keycode);
+}
+#else
+static inline void sparse_keymap_all_counts_check(struct sparse_keymap_all_dev *sd,
+                          struct input_dev *dev)
+{
+}
+#endif
+
+static void sparse_keymap_all_set_entry(struct sparse_keymap_all_dev *sd,
+                    struct key_entry *key, unsigned int keycode,
+                    unsigned long *touched)
+{
+    sparse_keymap_core_set_entry(&sd->core, key, keycode, touched);
+}
+
+static void sparse_keymap_all_update_keybit(struct sparse_keymap_all_dev *sd,
+                        struct input_dev *dev,
+                        const unsigned long *touched)
+{
+    sparse_keymap_core_update_keybit(&sd->core, dev->keybit, touched);
+}
+
+static struct key_entry *sparse_keymap_all_index_lookup(struct sparse_keymap_all_dev *sd,
+                        struct input_dev *dev, unsigned int code)
+{
+    return sparse_keymap_core_index_lookup(&sd->core, dev->keycode, code);
+}
+
+/*
+ * sparse_keymap_setup() stores the number of entries before KE_END in
+ * dev->keycodemax, so index lookups need not walk the table: by index
+ * is array indexing and index-of is pointer arithmetic.
+ */
 static unsigned int sparse_keymap_get_key_index(struct input_dev *dev,
                         const struct key_entry *k)
 {
-    struct key_entry *key;
-    unsigned int idx = 0;
-    for (key = dev->keycode; key->type != KE_END; key++) {
-        if (key == k)
-            break;
-        idx++;
-    }
-    return idx;
+    return k - (const struct key_entry *)dev->keycode;
 }
 
 static struct key_entry *sparse_keymap_entry_by_index_all(struct input_dev *dev,
                               unsigned int index)
 {
-    struct key_entry *key;
-    unsigned int key_cnt = 0;
-    for (key = dev->keycode; key->type != KE_END; key++)
-        if (key_cnt++ == index)
-            return key;
-    return NULL;
+    struct sparse_keymap_all_dev *sd = sparse_keymap_all_find(dev);
+    struct key_entry *keymap = dev->keycode;
+
+    if (sd)
+        return sparse_keymap_core_entry_by_index(&sd->core, keymap, index);
+    return index < dev->keycodemax ? &keymap[index] : NULL;
 }
 
 /**
@@ -131,13 +274,99 @@ static struct key_entry *sparse_keymap_entry_by_index_all(struct input_dev *dev,
 static struct key_entry *sparse_keymap_entry_from_scancode_all(struct input_dev *dev,
                             unsigned int code)
 {
+    struct sparse_keymap_all_dev *sd = sparse_keymap_all_find(dev);
     struct key_entry *key;
+
+    if (sd)
+        return sparse_keymap_all_index_lookup(sd, dev, code);
     for (key = dev->keycode; key->type != KE_END; key++)
         if (code == key->code)
             return key;
     return NULL;
 }
 
+/*
+ * Lookup for the reporting path (sparse_keymap_report_event() and drivers
+ * that look up scancodes themselves), which runs without event_lock,
+ * often in atomic context. It probes the same hash index as get/set,
+ * retrying if the index or the table changed under it. If @copy is
+ * given, the entry found is copied to it inside the read section.
+ */
+static struct key_entry *sparse_keymap_report_lookup(struct input_dev *dev,
+                             unsigned int code,
+                             struct key_entry *copy)
+{
+    struct sparse_keymap_all_dev *sd;
+    struct key_entry *keymap, *key;
+    unsigned int idx, seq;
+
+    rcu_read_lock();
+    sd = sparse_keymap_all_find(dev);
+    if (!sd) {
+        rcu_read_unlock();
+        for (key = dev->keycode; key->type != KE_END; key++)
+            if (code == key->code)
+                break;
+        if (key->type == KE_END)
+            return NULL;
+        if (copy)
+            *copy = *key;
+        return key;
+    }
+
+    do {
+        seq = read_seqcount_begin(&sd->seq);
+        keymap = READ_ONCE(dev->keycode);
+        key = sparse_keymap_core_index_lookup(&sd->core, keymap, code);
+        if (key && copy)
+            *copy = *key;
+    } while (read_seqcount_retry(&sd->seq, seq));
+
+    if (key) {
+        this_cpu_inc(sd->hits[key - keymap]);
+    } else {
+        this_cpu_inc(sd->hits[sd->core.count]);
+        idx = atomic_inc_return(&sd->unknown_next) - 1;
+        WRITE_ONCE(sd->unknown[idx % ARRAY_SIZE(sd->unknown)], code);
+    }
+    rcu_read_unlock();
+    return key;
+}
+
+/*
+ * Replacement of sparse_keymap_entry_from_scancode() on the reporting
+ * path. The entry stays allocated as long as the device, even across
+ * replaces, see replace_commit().
+ */
+static struct key_entry *sparse_keymap_entry_from_scancode_report(struct input_dev *dev,
+                                 unsigned int code)
+{
+    return sparse_keymap_report_lookup(dev, code, NULL);
+}
+
+/*
+ * Replacement of sparse_keymap_report_event(): the same, but the event is
+ * reported from a copy of the entry taken inside the read section, so it
+ * is translated with one complete table even if a replace frees it.
+ */
+static bool sparse_keymap_report_event_all(struct input_dev *dev, unsigned int code,
+                       unsigned int value, bool autorelease)
+{
+    struct key_entry ke;
+
+    if (sparse_keymap_report_lookup(dev, code, &ke)) {
+        sparse_keymap_report_entry(dev, &ke, value, autorelease);
+        return true;
+    }
+
+    // as the stock function, a debugging aid
+    ke.type = KE_KEY;
+    ke.code = code;
+    ke.keycode = KEY_UNKNOWN;
+    sparse_keymap_report_entry(dev, &ke, value, true);
+    return false;
+}
+
 /**
  * sparse_keymap_entry_from_keycode - perform sparse keymap lookup
  * @dev: Input device using sparse keymap
@@ -194,7 +423,10 @@ static int sparse_keymap_setkeycode_all(struct input_dev *dev,
                     const struct input_keymap_entry *ke,
                     unsigned int *old_keycode)
 {
+    DECLARE_BITMAP(touched, KEY_CNT);
+    struct sparse_keymap_all_dev *sd;
     struct key_entry *key;
+    unsigned int code;
     int old_type;
 
     if (dev->keycode) {
@@ -203,6 +435,29 @@ static int sparse_keymap_setkeycode_all(struct input_dev *dev,
             if (ke->len > sizeof(key->code))
                 return -EINVAL;
 
+            sd = sparse_keymap_all_find(dev);
+            if (sd) {
+                if (sd->core.counts_stale)
+                    sparse_keymap_all_counts_build(sd, dev);
+                *old_keycode = key->keycode;
+                code = 0;
+                memcpy(&code, ke->scancode, ke->len);
+
+                // a new scancode is looked up by the next report already
+                bitmap_zero(touched, KEY_CNT);
+                write_seqcount_begin(&sd->seq);
+                sparse_keymap_all_set_entry(sd, key, ke->keycode, touched);
+                if (key->code != code) {
+                    WRITE_ONCE(key->code, code);
+                    __sparse_keymap_all_index_build(sd, dev);
+                }
+                write_seqcount_end(&sd->seq);
+                sparse_keymap_all_update_keybit(sd, dev, touched);
+
+                sparse_keymap_all_counts_check(sd, dev);
+                return 0;
+            }
+
             old_type = key->type;
             *old_keycode = key->keycode;
 
@@ -245,115 +500,944 @@ static int sparse_keymap_setkeycode_all(struct input_dev *dev,
     return -EINVAL;
 }
 
-// kprobe pre_handler: called just before the probed instruction is executed
+/*
+ * hid-input keeps no keymap table: hidinput_getkeycode/setkeycode walk
+ * every usage of every report of the HID device (those of type EV_KEY or
+ * unmapped, unmapped ones being the hidden entries) to find one by index
+ * or usage. The override enumerates them once, in the same order, into
+ * usages[] and a shadow key_entry table (scancode page << 16 | usage,
+ * KE_IGNORE for unmapped usages and KEY_RESERVED) that core indexes and
+ * counts, and keeps both in step with the usages on every set. The
+ * reporting path uses the usages directly and needs no hook, so these
+ * devices have no per-entry hits.
+ *
+ * Only devices whose getkeycode/setkeycode are hid-input's own match:
+ * other HID drivers register input devices with drvdata of their own,
+ * which is not a hid_device. The functions are compared by symbol name,
+ * as the hooks are installed by name.
+ */
+static bool sparse_keymap_all_is_func(const void *func, const char *name)
+{
+    char sym[KSYM_SYMBOL_LEN];
+    size_t len = strlen(name);
+
+    if (!func)
+        return false;
+    // "name [module]" for functions in modules
+    sprint_symbol_no_offset(sym, (unsigned long)func);
+    return !strncmp(sym, name, len) && (sym[len] == 0 || sym[len] == ' ');
+}
+
+static bool sparse_keymap_all_match_hid(struct input_dev *dev)
+{
+    return !dev->keycode &&
+        sparse_keymap_all_is_func(dev->getkeycode, "hidinput_getkeycode") &&
+        sparse_keymap_all_is_func(dev->setkeycode, "hidinput_setkeycode");
+}
 
-static int sparse_keymap_getkeycode_pre(struct kprobe *p, struct pt_regs *regs)
+static unsigned int sparse_keymap_all_hid_walk(struct input_dev *dev,
+                           struct hid_usage **usages)
 {
-#ifdef CONFIG_X86
-    pr_info("<%s> getkeycode_pre: p->addr = 0x%p, ip = %lx, flags = 0x%lx\n",
-        p->symbol_name, p->addr, regs->ip, regs->flags);
-    regs->ip = (ulong) &sparse_keymap_getkeycode_all;
-    return 1; // stop single stepping and just return to the given address
-#endif
-#ifdef CONFIG_PPC
-    pr_info("<%s> getkeycode_pre: p->addr = 0x%p, nip = 0x%lx, msr = 0x%lx\n",
-        p->symbol_name, p->addr, regs->nip, regs->msr);
-#endif
-#ifdef CONFIG_MIPS
-    pr_info("<%s> getkeycode_pre: p->addr = 0x%p, epc = 0x%lx, status = 0x%lx\n",
-        p->symbol_name, p->addr, regs->cp0_epc, regs->cp0_status);
-#endif
-#ifdef CONFIG_ARM64
-    pr_info("<%s> getkeycode_pre: p->addr = 0x%p, pc = 0x%lx,"
-            " pstate = 0x%lx\n",
-        p->symbol_name, p->addr, (long)regs->pc, (long)regs->pstate);
-#endif
-#ifdef CONFIG_S390
-    pr_info("<%s> getkeycode_pre: p->addr, 0x%p, ip = 0x%lx, flags = 0x%lx\n",
-        p->symbol_name, p->addr, regs->psw.addr, regs->flags);
-#endif
+    struct hid_device *hid = input_get_drvdata(dev);
+    struct hid_report *report;
+    struct hid_usage *usage;
+    unsigned int i, j, k, n = 0;
+
+    for (k = HID_INPUT_REPORT; k <= HID_OUTPUT_REPORT; k++)
+        list_for_each_entry(report, &hid->report_enum[k].report_list, list)
+            for (i = 0; i < report->maxfield; i++)
+                for (j = 0; j < report->field[i]->maxusage; j++) {
+                    usage = report->field[i]->usage + j;
+                    if (usage->type != EV_KEY && usage->type != 0)
+                        continue;
+                    if (usages)
+                        usages[n] = usage;
+                    n++;
+                }
+    return n;
+}
+
+static unsigned int sparse_keymap_all_hid_count(struct input_dev *dev)
+{
+    return sparse_keymap_all_hid_walk(dev, NULL);
+}
+
+// shadow from the usages, on attach and after the stock functions ran
+static void sparse_keymap_all_hid_sync(struct sparse_keymap_all_dev *sd)
+{
+    unsigned int i, count = sd->core.count;
+    struct hid_usage *usage;
+
+    for (i = 0; i < count; i++) {
+        usage = sd->usages[i];
+        sd->shadow[i].code = usage->hid & (HID_USAGE_PAGE | HID_USAGE);
+        sd->shadow[i].keycode = usage->type == EV_KEY ? usage->code : KEY_RESERVED;
+        sd->shadow[i].type = sd->shadow[i].keycode != KEY_RESERVED ?
+            KE_KEY : KE_IGNORE;
+    }
+    sd->shadow[count].type = KE_END;
+}
+
+static int sparse_keymap_all_hid_attach(struct sparse_keymap_all_dev *sd,
+                    struct input_dev *dev)
+{
+    unsigned int count = sd->core.count;
 
-    /* A dump_stack() here will give a stack backtrace */
+    sd->usages = kvcalloc(count, sizeof(*sd->usages), GFP_KERNEL);
+    sd->shadow = kvcalloc(count + 1, sizeof(*sd->shadow), GFP_KERNEL);
+    if (!sd->usages || !sd->shadow)
+        return -ENOMEM;
+    sparse_keymap_all_hid_walk(dev, sd->usages);
+    sparse_keymap_all_hid_sync(sd);
     return 0;
 }
 
-static int sparse_keymap_setkeycode_pre(struct kprobe *p, struct pt_regs *regs)
+static struct key_entry *sparse_keymap_all_hid_locate(struct sparse_keymap_all_dev *sd,
+                              const struct input_keymap_entry *ke)
 {
-#ifdef CONFIG_X86
-    pr_info("<%s> setkeycode_pre: p->addr = 0x%p, ip = %lx, flags = 0x%lx\n",
-        p->symbol_name, p->addr, regs->ip, regs->flags);
-    regs->ip = (ulong) &sparse_keymap_setkeycode_all;
-    return 1; // stop single stepping and just return to the given address
-#endif
-#ifdef CONFIG_PPC
-    pr_info("<%s> setkeycode_pre: p->addr = 0x%p, nip = 0x%lx, msr = 0x%lx\n",
-        p->symbol_name, p->addr, regs->nip, regs->msr);
-#endif
-#ifdef CONFIG_MIPS
-    pr_info("<%s> setkeycode_pre: p->addr = 0x%p, epc = 0x%lx, status = 0x%lx\n",
-        p->symbol_name, p->addr, regs->cp0_epc, regs->cp0_status);
-#endif
-#ifdef CONFIG_ARM64
-    pr_info("<%s> setkeycode_pre: p->addr = 0x%p, pc = 0x%lx,"
-            " pstate = 0x%lx\n",
-        p->symbol_name, p->addr, (long)regs->pc, (long)regs->pstate);
-#endif
-#ifdef CONFIG_S390
-    pr_info("<%s> setkeycode_pre: p->addr, 0x%p, ip = 0x%lx, flags = 0x%lx\n",
-        p->symbol_name, p->addr, regs->psw.addr, regs->flags);
+    unsigned int scancode;
+
+    if (ke->flags & INPUT_KEYMAP_BY_INDEX)
+        return sparse_keymap_core_entry_by_index(&sd->core, sd->shadow, ke->index);
+    if (input_scancode_to_scalar(ke, &scancode) == 0)
+        return sparse_keymap_core_index_lookup(&sd->core, sd->shadow, scancode);
+    return NULL;
+}
+
+static int hidinput_getkeycode_all(struct input_dev *dev,
+                   struct input_keymap_entry *ke)
+{
+    struct sparse_keymap_all_dev *sd = sparse_keymap_all_find(dev);
+    const struct hid_usage *usage;
+    const struct key_entry *key;
+    unsigned int scancode;
+
+    key = sd ? sparse_keymap_all_hid_locate(sd, ke) : NULL;
+    if (!key)
+        return -EINVAL;
+    ke->index = key - sd->shadow;
+    usage = sd->usages[ke->index];
+    ke->keycode = usage->type == EV_KEY ? usage->code : KEY_RESERVED;
+    scancode = key->code;
+    ke->len = sizeof(scancode);
+    memcpy(ke->scancode, &scancode, sizeof(scancode));
+    return 0;
+}
+
+static int hidinput_setkeycode_all(struct input_dev *dev,
+                   const struct input_keymap_entry *ke,
+                   unsigned int *old_keycode)
+{
+    struct sparse_keymap_all_dev *sd = sparse_keymap_all_find(dev);
+    DECLARE_BITMAP(touched, KEY_CNT);
+    struct hid_usage *usage;
+    struct key_entry *key;
+
+    key = sd ? sparse_keymap_all_hid_locate(sd, ke) : NULL;
+    if (!key)
+        return -EINVAL;
+    usage = sd->usages[key - sd->shadow];
+    *old_keycode = usage->type == EV_KEY ? usage->code : KEY_RESERVED;
+
+    if (sd->core.counts_stale)
+        sparse_keymap_all_counts_build(sd, dev);
+    bitmap_zero(touched, KEY_CNT);
+    sparse_keymap_all_set_entry(sd, key, ke->keycode, touched);
+    usage->type = EV_KEY;
+    usage->code = ke->keycode;
+    sparse_keymap_all_update_keybit(sd, dev, touched);
+    sparse_keymap_all_counts_check(sd, dev);
+    return 0;
+}
+
+/*
+ * Overrides: one entry per keymap format the module knows how to look up,
+ * with the devices it applies to and, in hooks[], the functions it
+ * redirects. The overrides= parameter picks the ones installed at load
+ * time. Each device is matched by a single override and has its own
+ * index and counters, so adding one costs the others nothing.
+ *
+ * count gives the number of entries of a device and attach, if set,
+ * builds the shadow table, which sync brings up to date with the
+ * driver's entries. key_entry overrides, whose table is
+ * dev->keycode, also get the keymap, replace and hits files.
+ */
+struct sparse_keymap_all_override {
+    const char *name;
+    bool (*match)(struct input_dev *dev);
+    unsigned int (*count)(struct input_dev *dev);
+    int (*attach)(struct sparse_keymap_all_dev *sd, struct input_dev *dev);
+    void (*sync)(struct sparse_keymap_all_dev *sd);
+    bool key_entry;
+    bool enabled;
+};
+
+static bool sparse_keymap_all_match_key_entry(struct input_dev *dev)
+{
+    return dev->keycode && dev->keycodesize == sizeof(struct key_entry);
+}
+
+static unsigned int sparse_keymap_all_key_entry_count(struct input_dev *dev)
+{
+    return dev->keycodemax;
+}
+
+enum { SKA_SPARSE_KEYMAP, SKA_HID_INPUT };
+
+static struct sparse_keymap_all_override overrides[] = {
+    [SKA_SPARSE_KEYMAP] = {
+        .name = "sparse_keymap",
+        .match = sparse_keymap_all_match_key_entry,
+        .count = sparse_keymap_all_key_entry_count,
+        .key_entry = true,
+    },
+    [SKA_HID_INPUT] = {
+        .name = "hid_input",
+        .match = sparse_keymap_all_match_hid,
+        .count = sparse_keymap_all_hid_count,
+        .attach = sparse_keymap_all_hid_attach,
+        .sync = sparse_keymap_all_hid_sync,
+    },
+};
+
+static char *override_names = "sparse_keymap";
+module_param_named(overrides, override_names, charp, 0444);
+MODULE_PARM_DESC(overrides, "Comma-separated overrides to install: "
+         "sparse_keymap, hid_input (default: sparse_keymap)");
+
+static const struct sparse_keymap_all_override *sparse_keymap_all_override_for(struct input_dev *dev)
+{
+    for (int i = 0; i < ARRAY_SIZE(overrides); i++)
+        if (overrides[i].enabled && overrides[i].match(dev))
+            return &overrides[i];
+    return NULL;
+}
+
+static int __init sparse_keymap_all_overrides_parse(void)
+{
+    char *names, *p, *name;
+    int i, ret = 0;
+
+    p = names = kstrdup(override_names, GFP_KERNEL);
+    if (!names)
+        return -ENOMEM;
+    while ((name = strsep(&p, ","))) {
+        name = strim(name);
+        if (!*name)
+            continue;
+        for (i = 0; i < ARRAY_SIZE(overrides); i++)
+            if (!strcmp(name, overrides[i].name))
+                break;
+        if (i == ARRAY_SIZE(overrides)) {
+            pr_err("unknown override %s\n", name);
+            ret = -EINVAL;
+            break;
+        }
+        overrides[i].enabled = true;
+    }
+    kfree(names);
+    return ret;
+}
+
+/*
+ * The stock functions are redirected with ftrace, the way livepatch does
+ * it: the handler runs at the patched call site at function entry and
+ * changes the instruction pointer to the replacement, which then returns
+ * straight to the caller. This is a plain call on x86_64 and arm64, no
+ * breakpoint trap. The handler only counts hits (see debugfs hits) and
+ * logs with pr_debug, which is off unless enabled with dynamic debug.
+ *
+ * Needs a 5.11+ kernel with DYNAMIC_FTRACE_WITH_REGS or, since 6.2,
+ * DYNAMIC_FTRACE_WITH_ARGS (arm64 only has the latter).
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0) && \
+    defined(CONFIG_HAVE_DYNAMIC_FTRACE_WITH_ARGS)
+#define SKA_FTRACE_FLAGS FTRACE_OPS_FL_IPMODIFY
+
+static inline void sparse_keymap_all_set_ip(struct ftrace_regs *fregs,
+                        unsigned long ip)
+{
+    ftrace_regs_set_instruction_pointer(fregs, ip);
+}
+
+static inline unsigned long sparse_keymap_all_arg0(struct ftrace_regs *fregs)
+{
+    return ftrace_regs_get_argument(fregs, 0);
+}
+#else
+#define SKA_FTRACE_FLAGS (FTRACE_OPS_FL_SAVE_REGS | FTRACE_OPS_FL_IPMODIFY)
+
+static inline void sparse_keymap_all_set_ip(struct ftrace_regs *fregs,
+                        unsigned long ip)
+{
+    instruction_pointer_set(ftrace_get_regs(fregs), ip);
+}
+
+static inline unsigned long sparse_keymap_all_arg0(struct ftrace_regs *fregs)
+{
+    return regs_get_kernel_argument(ftrace_get_regs(fregs), 0);
+}
 #endif
 
-    /* A dump_stack() here will give a stack backtrace */
+struct sparse_keymap_all_hook {
+    const struct sparse_keymap_all_override *override;
+    const char *name;
+    void *func;
+    struct ftrace_ops ops;
+    atomic_long_t hits;
+    atomic_long_t passed;
+};
+
+static void notrace sparse_keymap_all_ftrace(unsigned long ip,
+                         unsigned long parent_ip,
+                         struct ftrace_ops *ops,
+                         struct ftrace_regs *fregs)
+{
+    struct sparse_keymap_all_hook *hook =
+        container_of(ops, struct sparse_keymap_all_hook, ops);
+    struct input_dev *dev = (struct input_dev *)sparse_keymap_all_arg0(fregs);
+    struct sparse_keymap_all_dev *sd = sparse_keymap_all_find(dev);
+
+    // not tracked, another format or not allowed: let the stock function run
+    if (!sd || sd->override != hook->override || !READ_ONCE(sd->allowed)) {
+        atomic_long_inc(&hook->passed);
+        return;
+    }
+    atomic_long_inc(&hook->hits);
+    pr_debug("%s: called from %pS\n", hook->name, (void *)parent_ip);
+    sparse_keymap_all_set_ip(fregs, (unsigned long)hook->func);
+}
+
+#define SKA_HOOK(ovr, sym, replacement) { \
+    .override = &overrides[ovr], \
+    .name = sym, \
+    .func = replacement, \
+    .ops = { \
+        .func = sparse_keymap_all_ftrace, \
+        .flags = SKA_FTRACE_FLAGS, \
+    }, \
+}
+
+static struct sparse_keymap_all_hook hooks[] = {
+    SKA_HOOK(SKA_SPARSE_KEYMAP, "sparse_keymap_getkeycode",
+         sparse_keymap_getkeycode_all),
+    SKA_HOOK(SKA_SPARSE_KEYMAP, "sparse_keymap_setkeycode",
+         sparse_keymap_setkeycode_all),
+    SKA_HOOK(SKA_SPARSE_KEYMAP, "sparse_keymap_entry_from_scancode",
+         sparse_keymap_entry_from_scancode_report),
+    SKA_HOOK(SKA_SPARSE_KEYMAP, "sparse_keymap_report_event",
+         sparse_keymap_report_event_all),
+    // static in hid-input.c, found by name like the others
+    SKA_HOOK(SKA_HID_INPUT, "hidinput_getkeycode", hidinput_getkeycode_all),
+    SKA_HOOK(SKA_HID_INPUT, "hidinput_setkeycode", hidinput_setkeycode_all),
+};
+
+static int sparse_keymap_all_hook_install(struct sparse_keymap_all_hook *hook)
+{
+    int ret;
+
+    // static functions are found by name, like in available_filter_functions
+    ret = ftrace_set_filter(&hook->ops, (unsigned char *)hook->name,
+                strlen(hook->name), 0);
+    if (ret) {
+        pr_err("%s: ftrace_set_filter failed, returned %d\n", hook->name, ret);
+        return ret;
+    }
+    ret = register_ftrace_function(&hook->ops);
+    if (ret) {
+        pr_err("%s: register_ftrace_function failed, returned %d\n",
+            hook->name, ret);
+        ftrace_set_filter(&hook->ops, NULL, 0, 1);
+        return ret;
+    }
+    pr_info("Redirected %s to %ps\n", hook->name, hook->func);
+    return 0;
+}
+
+static void sparse_keymap_all_hook_remove(struct sparse_keymap_all_hook *hook)
+{
+    unregister_ftrace_function(&hook->ops);
+    ftrace_set_filter(&hook->ops, NULL, 0, 1);
+    pr_info("Removed redirection of %s\n", hook->name);
+}
+
+/*
+ * Bulk keymap access, see sparse-keymap-all.h for the format. Reads are
+ * served from a snapshot of the whole table taken at open time.
+ */
+#define SKA_BATCH_MAX 65536
+
+struct sparse_keymap_all_snapshot {
+    size_t size;
+    struct sparse_keymap_all_entry entries[];
+};
+
+static int keymap_open(struct inode *inode, struct file *file)
+{
+    struct sparse_keymap_all_dev *sd = inode->i_private;
+    struct input_dev *dev = sd->handle.dev;
+    struct sparse_keymap_all_snapshot *snap;
+    const struct key_entry *keymap;
+    unsigned long flags;
+    unsigned int i;
+
+    file->private_data = NULL;
+    if (!(file->f_mode & FMODE_READ))
+        return 0;
+
+    snap = kvzalloc(struct_size(snap, entries, sd->core.count), GFP_KERNEL);
+    if (!snap)
+        return -ENOMEM;
+    snap->size = sd->core.count * sizeof(snap->entries[0]);
+    spin_lock_irqsave(&dev->event_lock, flags);
+    keymap = dev->keycode;
+    for (i = 0; i < sd->core.count; i++) {
+        snap->entries[i].code = keymap[i].code;
+        snap->entries[i].keycode = keymap[i].keycode;
+        snap->entries[i].type = keymap[i].type;
+    }
+    spin_unlock_irqrestore(&dev->event_lock, flags);
+    file->private_data = snap;
+    return nonseekable_open(inode, file);
+}
+
+static ssize_t keymap_read(struct file *file, char __user *buf,
+               size_t count, loff_t *ppos)
+{
+    struct sparse_keymap_all_snapshot *snap = file->private_data;
+
+    return simple_read_from_buffer(buf, count, ppos, snap->entries, snap->size);
+}
+
+static ssize_t keymap_write(struct file *file, const char __user *buf,
+                size_t count, loff_t *ppos)
+{
+    struct sparse_keymap_all_dev *sd = file_inode(file)->i_private;
+    struct input_dev *dev = sd->handle.dev;
+    struct sparse_keymap_all_entry *batch;
+    DECLARE_BITMAP(touched, KEY_CNT);
+    struct key_entry *key;
+    unsigned long flags;
+    size_t i, n = count / sizeof(*batch);
+    ssize_t ret = count;
+
+    if (count % sizeof(*batch) || n > SKA_BATCH_MAX)
+        return -EINVAL;
+    batch = vmemdup_user(buf, count);
+    if (IS_ERR(batch))
+        return PTR_ERR(batch);
+    for (i = 0; i < n; i++)
+        if (batch[i].keycode > KEY_MAX) {
+            ret = -EINVAL;
+            goto out;
+        }
+
+    bitmap_zero(touched, KEY_CNT);
+    spin_lock_irqsave(&dev->event_lock, flags);
+    // the stock functions own the table of a device not allowed
+    if (!sd->allowed) {
+        spin_unlock_irqrestore(&dev->event_lock, flags);
+        ret = -EPERM;
+        goto out;
+    }
+    if (sd->core.counts_stale)
+        sparse_keymap_all_counts_build(sd, dev);
+    for (i = 0; i < n; i++) {
+        key = sparse_keymap_all_index_lookup(sd, dev, batch[i].code);
+        if (!key || (key->type != KE_KEY && key->type != KE_IGNORE)) {
+            ret = key ? -EINVAL : -ENOENT;
+            break;
+        }
+    }
+    if (ret > 0) {
+        write_seqcount_begin(&sd->seq);
+        for (i = 0; i < n; i++) {
+            key = sparse_keymap_all_index_lookup(sd, dev, batch[i].code);
+            sparse_keymap_all_set_entry(sd, key, batch[i].keycode, touched);
+        }
+        write_seqcount_end(&sd->seq);
+        sparse_keymap_all_update_keybit(sd, dev, touched);
+        sparse_keymap_all_counts_check(sd, dev);
+    }
+    spin_unlock_irqrestore(&dev->event_lock, flags);
+out:
+    kvfree(batch);
+    return ret;
+}
+
+static int keymap_release(struct inode *inode, struct file *file)
+{
+    kvfree(file->private_data);
     return 0;
 }
 
+static const struct file_operations keymap_fops = {
+    .owner = THIS_MODULE,
+    .open = keymap_open,
+    .read = keymap_read,
+    .write = keymap_write,
+    .release = keymap_release,
+};
+
 /*
- * fault_handler: this is called if an exception is generated for any
- * instruction within the pre- or post-handler, or when Kprobes
- * single-steps the probed instruction.
+ * Whole table replacement. The new table, in the same record format and
+ * with exactly as many records as the device has entries, is staged by
+ * one or more writes; the write that completes it validates it, fills
+ * a newly allocated key_entry array and swaps it with dev->keycode under
+ * a single dev->event_lock acquisition, rebuilding the index and counts
+ * and updating dev->keybit once. Lookups on the reporting path, which do
+ * not take event_lock, see either the old or the new table. The old
+ * table is never rewritten and stays allocated until the device goes
+ * away, as drivers may still hold entries of it (devres frees them all
+ * then, so each replace costs one table until unplug);
+ * sparse_keymap_report_event() reports from a copy anyway.
+ *
+ * Only KE_KEY and KE_IGNORE entries can be changed, other entries
+ * (KE_SW, KE_VSW) must be given unchanged.
  */
-static int handler_fault(struct kprobe *p, struct pt_regs *regs, int trapnr)
+struct sparse_keymap_all_stage {
+    size_t size, filled;
+    struct sparse_keymap_all_entry entries[];
+};
+
+static int replace_open(struct inode *inode, struct file *file)
 {
-    pr_info("fault_handler: p->addr = 0x%p, trap #%dn", p->addr, trapnr);
-    /* Return 0 because we don't handle the fault. */
+    struct sparse_keymap_all_dev *sd = inode->i_private;
+    struct sparse_keymap_all_stage *stage;
+
+    stage = kvzalloc(struct_size(stage, entries, sd->core.count), GFP_KERNEL);
+    if (!stage)
+        return -ENOMEM;
+    stage->size = sd->core.count * sizeof(stage->entries[0]);
+    file->private_data = stage;
     return 0;
 }
 
-/* For each probe you need to allocate a kprobe structure */
-static struct kprobe kp[] = {
-    {
-        .symbol_name = "sparse_keymap_getkeycode",
-        .pre_handler = sparse_keymap_getkeycode_pre,
-        .fault_handler = handler_fault
-    },
+static bool replace_valid(const struct key_entry *old,
+              const struct sparse_keymap_all_entry *new)
+{
+    if (old->type == KE_KEY || old->type == KE_IGNORE)
+        return (new->type == KE_KEY || new->type == KE_IGNORE) &&
+            new->keycode <= KEY_MAX;
+    return new->type == old->type && new->code == old->code &&
+        new->keycode == old->keycode;
+}
+
+static int replace_commit(struct sparse_keymap_all_dev *sd,
+              const struct sparse_keymap_all_entry *entries)
+{
+    struct input_dev *dev = sd->handle.dev;
+    DECLARE_BITMAP(touched, KEY_CNT);
+    struct key_entry *keymap, *new;
+    unsigned long flags;
+    unsigned int i;
+    int ret = 0;
+
+    new = devm_kcalloc(&dev->dev, sd->core.count + 1, sizeof(*new), GFP_KERNEL);
+    if (!new)
+        return -ENOMEM;
+
+    bitmap_zero(touched, KEY_CNT);
+    spin_lock_irqsave(&dev->event_lock, flags);
+    keymap = dev->keycode;
+    for (i = 0; i < sd->core.count; i++)
+        if (!replace_valid(&keymap[i], &entries[i])) {
+            ret = -EINVAL;
+            goto out;
+        }
+
+    // copy KE_END too, the stock functions stop there
+    memcpy(new, keymap, (sd->core.count + 1) * sizeof(*new));
+    for (i = 0; i < sd->core.count; i++) {
+        if (new[i].type != KE_KEY && new[i].type != KE_IGNORE)
+            continue;
+        new[i].code = entries[i].code;
+        new[i].keycode = entries[i].keycode;
+        new[i].type = entries[i].keycode == KEY_RESERVED ?
+            KE_IGNORE : entries[i].type;
+    }
+
+    if (sd->core.counts_stale)
+        sparse_keymap_all_counts_build(sd, dev);
+    for (i = 0; i < KEY_CNT; i++)
+        if (sd->core.keycode_count[i])
+            __set_bit(i, touched);
+
+    write_seqcount_begin(&sd->seq);
+    WRITE_ONCE(dev->keycode, new);
+    __sparse_keymap_all_index_build(sd, dev);
+    write_seqcount_end(&sd->seq);
+
+    sparse_keymap_all_counts_build(sd, dev);
+    for (i = 0; i < KEY_CNT; i++)
+        if (sd->core.keycode_count[i])
+            __set_bit(i, touched);
+    sparse_keymap_all_update_keybit(sd, dev, touched);
+    sparse_keymap_all_counts_check(sd, dev);
+out:
+    spin_unlock_irqrestore(&dev->event_lock, flags);
+    if (ret)
+        devm_kfree(&dev->dev, new);
+    return ret;
+}
+
+static ssize_t replace_write(struct file *file, const char __user *buf,
+                 size_t count, loff_t *ppos)
+{
+    struct sparse_keymap_all_dev *sd = file_inode(file)->i_private;
+    struct sparse_keymap_all_stage *stage = file->private_data;
+    ssize_t ret;
+    int err;
+
+    if (*ppos != stage->filled)
+        return -EINVAL;
+    ret = simple_write_to_buffer(stage->entries, stage->size, ppos, buf, count);
+    if (ret <= 0)
+        return ret ? ret : -ENOSPC;
+    stage->filled = *ppos;
+    if (stage->filled < stage->size)
+        return ret;
+
+    // the allowlist changes under the same lock
+    mutex_lock(&sparse_keymap_all_lock);
+    err = sd->allowed ? replace_commit(sd, stage->entries) : -EPERM;
+    mutex_unlock(&sparse_keymap_all_lock);
+    return err ? err : ret;
+}
+
+static const struct file_operations replace_fops = {
+    .owner = THIS_MODULE,
+    .open = replace_open,
+    .write = replace_write,
+    .release = keymap_release,
+};
+
+/*
+ * inputN/hits: "index scancode type keycode hits" for each entry looked
+ * up on the reporting path since load or the last reset, then
+ * "unknown hits scancode..." with the most recent unknown scancodes.
+ * Writing anything resets the counters.
+ */
+static unsigned long hits_sum(struct sparse_keymap_all_dev *sd, unsigned int i)
+{
+    unsigned long sum = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        sum += per_cpu_ptr(sd->hits, cpu)[i];
+    return sum;
+}
+
+static int dev_hits_show(struct seq_file *m, void *v)
+{
+    struct sparse_keymap_all_dev *sd = m->private;
+    struct input_dev *dev = sd->handle.dev;
+    const struct key_entry *keymap;
+    struct key_entry key;
+    unsigned long flags, n;
+    unsigned int i, next;
+
+    for (i = 0; i < sd->core.count; i++) {
+        n = hits_sum(sd, i);
+        if (!n)
+            continue;
+        spin_lock_irqsave(&dev->event_lock, flags);
+        keymap = dev->keycode;
+        key = keymap[i];
+        spin_unlock_irqrestore(&dev->event_lock, flags);
+        seq_printf(m, "%u %08x %u %#x %lu\n", i, key.code, key.type,
+               key.keycode, n);
+    }
+
+    seq_printf(m, "unknown %lu", hits_sum(sd, sd->core.count));
+    next = atomic_read(&sd->unknown_next);
+    for (i = min_t(unsigned int, next, ARRAY_SIZE(sd->unknown)); i; i--)
+        seq_printf(m, " %08x",
+               READ_ONCE(sd->unknown[(next - i) % ARRAY_SIZE(sd->unknown)]));
+    seq_putc(m, '\n');
+    return 0;
+}
+
+static int dev_hits_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, dev_hits_show, inode->i_private);
+}
+
+static ssize_t dev_hits_write(struct file *file, const char __user *buf,
+                  size_t count, loff_t *ppos)
+{
+    struct sparse_keymap_all_dev *sd = file_inode(file)->i_private;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(sd->hits, cpu), 0,
+               (sd->core.count + 1) * sizeof(unsigned long));
+    atomic_set(&sd->unknown_next, 0);
+    return count;
+}
+
+static const struct file_operations dev_hits_fops = {
+    .owner = THIS_MODULE,
+    .open = dev_hits_open,
+    .read = seq_read,
+    .write = dev_hits_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/*
+ * devices=pattern[,pattern...] restricts the override to the devices
+ * whose name or phys matches one of the glob patterns, e.g.
+ * devices="Dell WMI hotkeys". Other devices keep the stock functions.
+ * Empty (the default) means all devices. Writable at runtime through
+ * /sys/module/sparse_keymap_all/parameters/devices.
+ */
+static char allowlist[256];
+
+static bool sparse_keymap_all_allowed(struct input_dev *dev)
+{
+    char pattern[sizeof(allowlist)];
+    const char *p = allowlist;
+    size_t len;
+
+    if (!allowlist[0])
+        return true;
+    while (*p) {
+        len = strcspn(p, ",");
+        memcpy(pattern, p, len);
+        pattern[len] = 0;
+        if ((dev->name && glob_match(pattern, dev->name)) ||
+            (dev->phys && glob_match(pattern, dev->phys)))
+            return true;
+        p += len;
+        if (*p == ',')
+            p++;
+    }
+    return false;
+}
+
+/*
+ * While a device is not allowed, the stock functions set its entries
+ * behind the core's back, so the index is rebuilt and the counts marked
+ * stale when the device is allowed again, before the replacements see it.
+ */
+static void sparse_keymap_all_allow(struct sparse_keymap_all_dev *sd, bool allowed)
+{
+    struct input_dev *dev = sd->handle.dev;
+    unsigned long flags;
+
+    if (allowed == sd->allowed)
+        return;
+    spin_lock_irqsave(&dev->event_lock, flags);
+    if (allowed) {
+        write_seqcount_begin(&sd->seq);
+        if (sd->override->sync)
+            sd->override->sync(sd);
+        __sparse_keymap_all_index_build(sd, dev);
+        write_seqcount_end(&sd->seq);
+        sd->core.counts_stale = true;
+    }
+    WRITE_ONCE(sd->allowed, allowed);
+    spin_unlock_irqrestore(&dev->event_lock, flags);
+}
+
+static int allowlist_set(const char *val, const struct kernel_param *kp)
+{
+    struct sparse_keymap_all_dev *sd;
+    int ret;
+
+    mutex_lock(&sparse_keymap_all_lock);
+    ret = param_set_copystring(val, kp);
+    if (!ret) {
+        strim(allowlist);
+        list_for_each_entry(sd, &sparse_keymap_all_devs, node)
+            sparse_keymap_all_allow(sd, sparse_keymap_all_allowed(sd->handle.dev));
+    }
+    mutex_unlock(&sparse_keymap_all_lock);
+    return ret;
+}
+
+static const struct kernel_param_ops allowlist_ops = {
+    .set = allowlist_set,
+    .get = param_get_string,
+};
+
+static struct kparam_string allowlist_string = {
+    .maxlen = sizeof(allowlist),
+    .string = allowlist,
+};
+
+module_param_cb(devices, &allowlist_ops, &allowlist_string, 0644);
+MODULE_PARM_DESC(devices, "Comma-separated name/phys glob patterns of the "
+         "devices to override (default: all)");
+
+/*
+ * Input handler that only tracks the devices of the installed overrides:
+ * it never opens them and receives no events.
+ */
+static bool sparse_keymap_all_match(struct input_handler *handler,
+                    struct input_dev *dev)
+{
+    return sparse_keymap_all_override_for(dev);
+}
+
+static int sparse_keymap_all_connect(struct input_handler *handler,
+                     struct input_dev *dev,
+                     const struct input_device_id *id)
+{
+    struct sparse_keymap_all_dev *sd;
+    unsigned long flags;
+    int error;
+
+    sd = kzalloc(sizeof(*sd), GFP_KERNEL);
+    if (!sd)
+        return -ENOMEM;
+    sd->override = sparse_keymap_all_override_for(dev);
+    sparse_keymap_core_init(&sd->core, sd->override->count(dev));
+    sd->core.index = kvcalloc(1U << sd->core.hash_bits, sizeof(*sd->core.index),
+                  GFP_KERNEL);
+    if (sd->override->key_entry)
+        sd->hits = __alloc_percpu((sd->core.count + 1) * sizeof(unsigned long),
+                      sizeof(unsigned long));
+    if (!sd->core.index || (sd->override->key_entry && !sd->hits)) {
+        error = -ENOMEM;
+        goto err_free;
+    }
+    if (sd->override->attach) {
+        error = sd->override->attach(sd, dev);
+        if (error)
+            goto err_free;
+    }
+    seqcount_init(&sd->seq);
+
+    sd->handle.dev = dev;
+    sd->handle.handler = handler;
+    sd->handle.name = "sparse-keymap-all";
+
+    // build the index now, the reporting path cannot do it lazily
+    spin_lock_irqsave(&dev->event_lock, flags);
+    __sparse_keymap_all_index_build(sd, dev);
+    spin_unlock_irqrestore(&dev->event_lock, flags);
+
+    error = input_register_handle(&sd->handle);
+    if (error)
+        goto err_free;
+
+    mutex_lock(&sparse_keymap_all_lock);
+    sd->allowed = sparse_keymap_all_allowed(dev);
+    list_add(&sd->node, &sparse_keymap_all_devs);
+    mutex_unlock(&sparse_keymap_all_lock);
+
+    if (sd->override->key_entry) {
+        sd->debugfs = debugfs_create_dir(dev_name(&dev->dev), debugfs_dir);
+        debugfs_create_file("keymap", 0600, sd->debugfs, sd, &keymap_fops);
+        debugfs_create_file("replace", 0200, sd->debugfs, sd, &replace_fops);
+        debugfs_create_file("hits", 0600, sd->debugfs, sd, &dev_hits_fops);
+    }
+    return 0;
+
+err_free:
+    free_percpu(sd->hits);
+    kvfree(sd->core.index);
+    kvfree(sd->shadow);
+    kvfree(sd->usages);
+    kfree(sd);
+    return error;
+}
+
+static void sparse_keymap_all_disconnect(struct input_handle *handle)
+{
+    struct sparse_keymap_all_dev *sd =
+        container_of(handle, struct sparse_keymap_all_dev, handle);
+
+    debugfs_remove_recursive(sd->debugfs);
+    mutex_lock(&sparse_keymap_all_lock);
+    list_del(&sd->node);
+    mutex_unlock(&sparse_keymap_all_lock);
+    input_unregister_handle(handle);
+    free_percpu(sd->hits);
+    kvfree(sd->core.index);
+    kvfree(sd->shadow);
+    kvfree(sd->usages);
+    kfree(sd);
+}
+
+static const struct input_device_id sparse_keymap_all_ids[] = {
     {
-        .symbol_name = "sparse_keymap_setkeycode",
-        .pre_handler = sparse_keymap_setkeycode_pre,
-        .fault_handler = handler_fault
+        .flags = INPUT_DEVICE_ID_MATCH_EVBIT,
+        .evbit = { BIT_MASK(EV_KEY) },
     },
+    { },
+};
+
+static struct input_handler sparse_keymap_all_handler = {
+    .match = sparse_keymap_all_match,
+    .connect = sparse_keymap_all_connect,
+    .disconnect = sparse_keymap_all_disconnect,
+    .name = "sparse-keymap-all",
+    .id_table = sparse_keymap_all_ids,
 };
 
+/*
+ * /sys/kernel/debug/sparse-keymap-all/hits: one line per redirected
+ * function, "symbol redirected passed", passed being the calls left to
+ * the stock function for devices outside the allowlist.
+ */
+
+static int hits_show(struct seq_file *m, void *v)
+{
+    for (int i = 0; i < ARRAY_SIZE(hooks); i++)
+        if (hooks[i].override->enabled)
+            seq_printf(m, "%s %ld %ld\n", hooks[i].name,
+                atomic_long_read(&hooks[i].hits),
+                atomic_long_read(&hooks[i].passed));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(hits);
+
+static void sparse_keymap_all_hooks_remove(int n)
+{
+    while (--n >= 0)
+        if (hooks[n].override->enabled)
+            sparse_keymap_all_hook_remove(&hooks[n]);
+}
+
 static int __init sparse_keymap_all_init(void)
 {
     int ret;
 
-    for (int i = 0; i < ARRAY_SIZE(kp); i++) {
-        ret = register_kprobe(&kp[i]);
+    ret = sparse_keymap_all_overrides_parse();
+    if (ret < 0)
+        return ret;
+
+    debugfs_dir = debugfs_create_dir("sparse-keymap-all", NULL);
+    debugfs_create_file("hits", 0444, debugfs_dir, NULL, &hits_fops);
+
+    ret = input_register_handler(&sparse_keymap_all_handler);
+    if (ret < 0) {
+        debugfs_remove_recursive(debugfs_dir);
+        return ret;
+    }
+
+    for (int i = 0; i < ARRAY_SIZE(hooks); i++) {
+        if (!hooks[i].override->enabled)
+            continue;
+        ret = sparse_keymap_all_hook_install(&hooks[i]);
         if (ret < 0) {
-            pr_err("register_kprobe failed, returned %d\n", ret);
+            sparse_keymap_all_hooks_remove(i);
+            input_unregister_handler(&sparse_keymap_all_handler);
+            debugfs_remove_recursive(debugfs_dir);
             return ret;
         }
-        pr_info("Planted kprobe %s at %p\n", kp[i].symbol_name, kp[i].addr);
     }
     return 0;
 }
 
 static void __exit sparse_keymap_all_exit(void)
 {
-    for (int i = 0; i < ARRAY_SIZE(kp); i++) {
-        unregister_kprobe(&kp[i]);
-        pr_info("Removed kprobe %s at %p\n", kp[i].symbol_name, kp[i].addr);
-    }
+    sparse_keymap_all_hooks_remove(ARRAY_SIZE(hooks));
+    input_unregister_handler(&sparse_keymap_all_handler);
+    debugfs_remove_recursive(debugfs_dir);
 }
 
 module_init(sparse_keymap_all_init)
@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: GPL-2.0-only WITH Linux-syscall-note */
+#ifndef SPARSE_KEYMAP_ALL_H
+#define SPARSE_KEYMAP_ALL_H
+
+#include <linux/types.h>
+
+/*
+ * Record format of /sys/kernel/debug/sparse-keymap-all/inputN/keymap.
+ *
+ * Reading returns the whole key_entry table of the device, KE_IGNORE
+ * entries included, as an array of these records in table order.
+ *
+ * Writing takes an array of records and sets the keycode of the entry
+ * with each scancode (type is ignored), as EVIOCSKEYCODE_V2 would, all
+ * under one lock acquisition: KEY_RESERVED turns a KE_KEY entry into
+ * KE_IGNORE and any other keycode turns KE_IGNORE into KE_KEY. Nothing
+ * is changed if one of the scancodes is not in the table (ENOENT).
+ */
+struct sparse_keymap_all_entry {
+    __u32 code;         /* scancode */
+    __u16 keycode;
+    __u8 type;          /* KE_KEY, KE_IGNORE, ... */
+    __u8 reserved;
+};
+
+#endif
@@ -0,0 +1,362 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Userspace tests and benchmarks of the sparse-keymap-all lookup core
+ * over synthetic tables of 10 to 64K entries, mostly KE_IGNORE like the
+ * dell_wmi ones.
+ *
+ *  $ make test         # KTAP output, exit status 1 on failure
+ *  $ make bench        # ns per operation, linear scan vs hash index
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <linux/input-event-codes.h>
+
+// as in <linux/input/sparse-keymap.h>
+enum { KE_END, KE_KEY, KE_SW, KE_VSW, KE_IGNORE };
+
+struct key_entry {
+    int type;
+    uint32_t code;
+    union {
+        uint16_t keycode;
+        struct {
+            uint8_t code;
+            uint8_t value;
+        } sw;
+    };
+};
+
+#include "sparse-keymap-core.h"
+
+static const unsigned int sizes[] = { 10, 100, 1000, 16384, 65536 };
+
+static uint32_t rnd_state = 2463534242U;
+
+static uint32_t rnd(void)
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state;
+}
+
+static unsigned int rnd_keycode(void)
+{
+    return 1 + rnd() % (KEY_MAX - 1);
+}
+
+/*
+ * count entries plus KE_END: random scancodes, one in ten KE_KEY with a
+ * random keycode, one in a hundred KE_SW, the rest KE_IGNORE.
+ */
+static struct key_entry *make_table(unsigned int count)
+{
+    struct key_entry *keymap = calloc(count + 1, sizeof(*keymap));
+    unsigned int i;
+
+    if (!keymap) {
+        perror("calloc");
+        exit(2);
+    }
+    for (i = 0; i < count; i++) {
+        keymap[i].code = rnd();
+        switch (rnd() % 100) {
+        case 0:
+            keymap[i].type = KE_SW;
+            keymap[i].sw.code = SW_LID;
+            break;
+        case 1 ... 10:
+            keymap[i].type = KE_KEY;
+            keymap[i].keycode = rnd_keycode();
+            break;
+        default:
+            keymap[i].type = KE_IGNORE;
+        }
+    }
+    keymap[count].type = KE_END;
+    return keymap;
+}
+
+static void core_setup(struct sparse_keymap_core *core, struct key_entry *keymap,
+               unsigned int count)
+{
+    sparse_keymap_core_init(core, count);
+    core->index = calloc(1U << core->hash_bits, sizeof(*core->index));
+    if (!core->index) {
+        perror("calloc");
+        exit(2);
+    }
+    sparse_keymap_core_index_build(core, keymap);
+    sparse_keymap_core_counts_build(core, keymap);
+}
+
+static void keybit_from_table(unsigned long *keybit, const struct key_entry *keymap,
+                  unsigned int count)
+{
+    unsigned int i;
+
+    memset(keybit, 0, SKC_BITMAP_LONGS(KEY_CNT) * sizeof(*keybit));
+    for (i = 0; i < count; i++)
+        if (keymap[i].type == KE_KEY)
+            SKC_SET_BIT(keymap[i].keycode, keybit);
+}
+
+/*
+ * KUnit-like test cases: EXPECT() records the first failure of a case
+ * and keeps going, results are printed as KTAP.
+ */
+struct test {
+    const char *name;
+    void (*run)(struct test *t);
+    bool failed;
+};
+
+#define EXPECT(t, cond) do { \
+    if (!(cond) && !(t)->failed) { \
+        (t)->failed = true; \
+        printf("    # %s:%d: expected %s\n", __FILE__, __LINE__, #cond); \
+    } \
+} while (0)
+
+static void test_lookup_matches_scan(struct test *t)
+{
+    for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        unsigned int count = sizes[s], i, code;
+        struct key_entry *keymap = make_table(count);
+        struct sparse_keymap_core core;
+
+        core_setup(&core, keymap, count);
+        for (i = 0; i < count; i++) {
+            code = keymap[i].code;
+            EXPECT(t, sparse_keymap_core_index_lookup(&core, keymap, code) ==
+                  sparse_keymap_core_scan(&core, keymap, code));
+        }
+        for (i = 0; i < 1000; i++) {
+            code = rnd();
+            EXPECT(t, sparse_keymap_core_index_lookup(&core, keymap, code) ==
+                  sparse_keymap_core_scan(&core, keymap, code));
+        }
+        free(core.index);
+        free(keymap);
+    }
+}
+
+static void test_duplicate_first_wins(struct test *t)
+{
+    struct key_entry *keymap = make_table(100);
+    struct sparse_keymap_core core;
+
+    keymap[70].code = keymap[30].code;
+    keymap[90].code = keymap[30].code;
+    core_setup(&core, keymap, 100);
+    EXPECT(t, sparse_keymap_core_index_lookup(&core, keymap, keymap[30].code) ==
+          &keymap[30]);
+    free(core.index);
+    free(keymap);
+}
+
+static void test_entry_by_index(struct test *t)
+{
+    struct key_entry *keymap = make_table(10);
+    struct sparse_keymap_core core;
+
+    core_setup(&core, keymap, 10);
+    EXPECT(t, sparse_keymap_core_entry_by_index(&core, keymap, 0) == &keymap[0]);
+    EXPECT(t, sparse_keymap_core_entry_by_index(&core, keymap, 9) == &keymap[9]);
+    EXPECT(t, sparse_keymap_core_entry_by_index(&core, keymap, 10) == NULL);
+    EXPECT(t, sparse_keymap_core_entry_by_index(&core, keymap, ~0U) == NULL);
+    free(core.index);
+    free(keymap);
+}
+
+static void test_set_entry_types(struct test *t)
+{
+    unsigned long touched[SKC_BITMAP_LONGS(KEY_CNT)] = { 0 };
+    struct key_entry keymap[4] = {
+        { .type = KE_KEY, .code = 1, .keycode = KEY_A },
+        { .type = KE_IGNORE, .code = 2 },
+        { .type = KE_KEY, .code = 3, .keycode = KEY_A },
+        { .type = KE_END },
+    };
+    struct sparse_keymap_core core;
+
+    core_setup(&core, keymap, 3);
+    EXPECT(t, core.keycode_count[KEY_A] == 2);
+
+    sparse_keymap_core_set_entry(&core, &keymap[0], KEY_RESERVED, touched);
+    EXPECT(t, keymap[0].type == KE_IGNORE);
+    EXPECT(t, core.keycode_count[KEY_A] == 1);
+    EXPECT(t, SKC_TEST_BIT(KEY_A, touched));
+
+    sparse_keymap_core_set_entry(&core, &keymap[1], KEY_B, touched);
+    EXPECT(t, keymap[1].type == KE_KEY && keymap[1].keycode == KEY_B);
+    EXPECT(t, core.keycode_count[KEY_B] == 1);
+    EXPECT(t, SKC_TEST_BIT(KEY_B, touched));
+    EXPECT(t, sparse_keymap_core_counts_check(&core, keymap) == -1);
+    free(core.index);
+}
+
+static void test_counts_and_keybit(struct test *t)
+{
+    for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        unsigned long keybit[SKC_BITMAP_LONGS(KEY_CNT)];
+        unsigned long expect[SKC_BITMAP_LONGS(KEY_CNT)];
+        unsigned long touched[SKC_BITMAP_LONGS(KEY_CNT)];
+        unsigned int count = sizes[s], i, j, keycode;
+        struct key_entry *keymap = make_table(count);
+        struct sparse_keymap_core core;
+
+        core_setup(&core, keymap, count);
+        EXPECT(t, sparse_keymap_core_counts_check(&core, keymap) == -1);
+        keybit_from_table(keybit, keymap, count);
+
+        // batches of 1 to 64 sets, one keybit update per batch
+        for (i = 0; i < 200; i++) {
+            memset(touched, 0, sizeof(touched));
+            for (j = rnd() % 64 + 1; j; j--) {
+                struct key_entry *key = &keymap[rnd() % count];
+
+                if (key->type != KE_KEY && key->type != KE_IGNORE)
+                    continue;
+                keycode = rnd() % 8 ? rnd_keycode() : KEY_RESERVED;
+                sparse_keymap_core_set_entry(&core, key, keycode, touched);
+            }
+            sparse_keymap_core_update_keybit(&core, keybit, touched);
+            keybit_from_table(expect, keymap, count);
+            EXPECT(t, !memcmp(keybit, expect, sizeof(keybit)));
+        }
+        EXPECT(t, sparse_keymap_core_counts_check(&core, keymap) == -1);
+        free(core.index);
+        free(keymap);
+    }
+}
+
+// 64K entries with one keycode must not wrap its count
+static void test_count_no_wrap(struct test *t)
+{
+    unsigned long keybit[SKC_BITMAP_LONGS(KEY_CNT)];
+    unsigned long touched[SKC_BITMAP_LONGS(KEY_CNT)] = { 0 };
+    unsigned int count = 65536, i;
+    struct key_entry *keymap = make_table(count);
+    struct sparse_keymap_core core;
+
+    for (i = 0; i < count; i++) {
+        keymap[i].type = KE_KEY;
+        keymap[i].keycode = KEY_A;
+    }
+    core_setup(&core, keymap, count);
+    keybit_from_table(keybit, keymap, count);
+    EXPECT(t, core.keycode_count[KEY_A] == count);
+
+    sparse_keymap_core_set_entry(&core, &keymap[0], KEY_RESERVED, touched);
+    sparse_keymap_core_update_keybit(&core, keybit, touched);
+    EXPECT(t, SKC_TEST_BIT(KEY_A, keybit));
+    free(core.index);
+    free(keymap);
+}
+
+static struct test tests[] = {
+    { .name = "lookup_matches_scan", .run = test_lookup_matches_scan },
+    { .name = "duplicate_first_wins", .run = test_duplicate_first_wins },
+    { .name = "entry_by_index", .run = test_entry_by_index },
+    { .name = "set_entry_types", .run = test_set_entry_types },
+    { .name = "counts_and_keybit", .run = test_counts_and_keybit },
+    { .name = "count_no_wrap", .run = test_count_no_wrap },
+};
+
+static int run_tests(void)
+{
+    unsigned int n = sizeof(tests) / sizeof(tests[0]), failed = 0;
+
+    printf("KTAP version 1\n1..%u\n", n);
+    for (unsigned int i = 0; i < n; i++) {
+        tests[i].run(&tests[i]);
+        failed += tests[i].failed;
+        printf("%sok %u %s\n", tests[i].failed ? "not " : "", i + 1, tests[i].name);
+    }
+    return failed ? 1 : 0;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// keeps the compiler from dropping the lookups
+static volatile uintptr_t sink;
+
+static void run_bench(void)
+{
+    printf("%8s %10s %10s %10s %10s\n", "entries", "scan", "index", "set", "build");
+    for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        unsigned long keybit[SKC_BITMAP_LONGS(KEY_CNT)];
+        unsigned long touched[SKC_BITMAP_LONGS(KEY_CNT)];
+        unsigned int count = sizes[s], i, n, *codes;
+        struct key_entry *keymap = make_table(count);
+        struct sparse_keymap_core core;
+        double t0, scan, index, set, build;
+
+        core_setup(&core, keymap, count);
+        keybit_from_table(keybit, keymap, count);
+
+        // existing scancodes in random order, as many lookups as fit
+        n = 1U << 16;
+        codes = malloc(n * sizeof(*codes));
+        for (i = 0; i < n; i++)
+            codes[i] = keymap[rnd() % count].code;
+
+        unsigned int scans = count > 1000 ? n / 64 : n;
+        t0 = now_ns();
+        for (i = 0; i < scans; i++)
+            sink = (uintptr_t)sparse_keymap_core_scan(&core, keymap, codes[i]);
+        scan = (now_ns() - t0) / scans;
+
+        t0 = now_ns();
+        for (i = 0; i < n; i++)
+            sink = (uintptr_t)sparse_keymap_core_index_lookup(&core, keymap, codes[i]);
+        index = (now_ns() - t0) / n;
+
+        t0 = now_ns();
+        for (i = 0; i < n; i++) {
+            struct key_entry *key = sparse_keymap_core_index_lookup(&core, keymap, codes[i]);
+
+            memset(touched, 0, sizeof(touched));
+            if (key->type == KE_KEY || key->type == KE_IGNORE)
+                sparse_keymap_core_set_entry(&core, key, codes[i] % KEY_MAX, touched);
+            sparse_keymap_core_update_keybit(&core, keybit, touched);
+        }
+        set = (now_ns() - t0) / n;
+
+        t0 = now_ns();
+        for (i = 0; i < 16; i++)
+            sparse_keymap_core_index_build(&core, keymap);
+        build = (now_ns() - t0) / 16;
+
+        printf("%8u %8.1fns %8.1fns %8.1fns %8.0fns\n", count, scan, index, set, build);
+        free(codes);
+        free(core.index);
+        free(keymap);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && !strcmp(argv[1], "-b")) {
+        run_bench();
+        return 0;
+    }
+    if (argc > 1) {
+        fprintf(stderr, "Usage: %s [-b]\n", argv[0]);
+        return 2;
+    }
+    return run_tests();
+}
@@ -0,0 +1,195 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef SPARSE_KEYMAP_CORE_H
+#define SPARSE_KEYMAP_CORE_H
+
+/*
+ * Keymap lookup core of sparse-keymap-all, shared with the userspace test
+ * and benchmark (sparse-keymap-core-test.c), so it has no kernel
+ * dependencies: the includer provides bool, memset(), struct key_entry and
+ * the KE_* and KEY_* constants, and may define SKC_READ_ONCE() and
+ * SKC_SET_BIT()/SKC_CLEAR_BIT() for lockless readers and shared bitmaps.
+ *
+ * The scancode index is an open-addressing hash table of entry indices
+ * (+1, 0 is an empty slot), at most half full; the includer allocates
+ * 1 << hash_bits slots. keycode_count[] holds the number of KE_KEY
+ * entries for each keycode, so a set can tell whether the old keycode is
+ * still in use and keep keybit up to date without scanning the table.
+ * The index must be rebuilt by whoever changes a scancode; the counts are
+ * built on first use and must be marked stale by the includer when the
+ * table changes behind the core's back (sparse-keymap-all: when a device
+ * comes back into the allowlist, after the stock functions ran on it).
+ */
+
+#ifndef SKC_READ_ONCE
+#define SKC_READ_ONCE(x) (x)
+#endif
+
+#define SKC_LONG_BITS (8 * sizeof(unsigned long))
+#define SKC_BITMAP_LONGS(n) (((n) + SKC_LONG_BITS - 1) / SKC_LONG_BITS)
+
+#ifndef SKC_SET_BIT
+#define SKC_SET_BIT(nr, addr) \
+    ((addr)[(nr) / SKC_LONG_BITS] |= 1UL << ((nr) % SKC_LONG_BITS))
+#define SKC_CLEAR_BIT(nr, addr) \
+    ((addr)[(nr) / SKC_LONG_BITS] &= ~(1UL << ((nr) % SKC_LONG_BITS)))
+#endif
+#define SKC_TEST_BIT(nr, addr) \
+    (((addr)[(nr) / SKC_LONG_BITS] >> ((nr) % SKC_LONG_BITS)) & 1)
+
+struct sparse_keymap_core {
+    unsigned int count;
+    unsigned int hash_bits;
+    bool counts_stale;
+    unsigned int *index;
+    unsigned int keycode_count[KEY_CNT];
+};
+
+// same as the generic hash_32()
+static inline unsigned int sparse_keymap_core_hash(unsigned int code,
+                           unsigned int bits)
+{
+    return (code * 0x61C88647U) >> (32 - bits);
+}
+
+static inline void sparse_keymap_core_init(struct sparse_keymap_core *core,
+                       unsigned int count)
+{
+    core->count = count;
+    for (core->hash_bits = 1; (1U << core->hash_bits) < count * 2; )
+        core->hash_bits++;
+    core->counts_stale = true;
+}
+
+static inline void sparse_keymap_core_index_build(struct sparse_keymap_core *core,
+                          const struct key_entry *keymap)
+{
+    unsigned int mask = (1U << core->hash_bits) - 1;
+    unsigned int i, slot;
+
+    memset(core->index, 0, sizeof(*core->index) << core->hash_bits);
+    for (i = 0; i < core->count; i++) {
+        slot = sparse_keymap_core_hash(keymap[i].code, core->hash_bits);
+        while (core->index[slot] &&
+               keymap[core->index[slot] - 1].code != keymap[i].code)
+            slot = (slot + 1) & mask;
+        // keep the first of duplicate scancodes, like the linear scan
+        if (!core->index[slot])
+            core->index[slot] = i + 1;
+    }
+}
+
+// the index must be up to date, see sparse_keymap_core_index_build()
+static inline struct key_entry *sparse_keymap_core_index_lookup(
+        const struct sparse_keymap_core *core, struct key_entry *keymap,
+        unsigned int code)
+{
+    unsigned int mask = (1U << core->hash_bits) - 1;
+    unsigned int slot, idx;
+
+    for (slot = sparse_keymap_core_hash(code, core->hash_bits);
+         (idx = SKC_READ_ONCE(core->index[slot]));
+         slot = (slot + 1) & mask)
+        if (keymap[idx - 1].code == code)
+            return &keymap[idx - 1];
+    return NULL;
+}
+
+static inline struct key_entry *sparse_keymap_core_scan(
+        const struct sparse_keymap_core *core, struct key_entry *keymap,
+        unsigned int code)
+{
+    unsigned int i;
+
+    for (i = 0; i < core->count; i++)
+        if (keymap[i].code == code)
+            return &keymap[i];
+    return NULL;
+}
+
+static inline struct key_entry *sparse_keymap_core_entry_by_index(
+        const struct sparse_keymap_core *core, struct key_entry *keymap,
+        unsigned int index)
+{
+    return index < core->count ? &keymap[index] : NULL;
+}
+
+static inline void sparse_keymap_core_counts_build(struct sparse_keymap_core *core,
+                           const struct key_entry *keymap)
+{
+    unsigned int i;
+
+    memset(core->keycode_count, 0, sizeof(core->keycode_count));
+    for (i = 0; i < core->count; i++)
+        if (keymap[i].type == KE_KEY && keymap[i].keycode < KEY_CNT)
+            core->keycode_count[keymap[i].keycode]++;
+    core->counts_stale = false;
+}
+
+/*
+ * Returns the first keycode whose count does not match the table, or -1.
+ * A full scan per keycode, for debug builds and tests.
+ */
+static inline int sparse_keymap_core_counts_check(const struct sparse_keymap_core *core,
+                          const struct key_entry *keymap)
+{
+    unsigned int i, keycode, n;
+
+    for (keycode = 0; keycode < KEY_CNT; keycode++) {
+        for (i = n = 0; i < core->count; i++)
+            if (keymap[i].type == KE_KEY && keymap[i].keycode == keycode)
+                n++;
+        if (n != core->keycode_count[keycode])
+            return keycode;
+    }
+    return -1;
+}
+
+/*
+ * Set the keycode of an entry the way a set does: KEY_RESERVED turns a
+ * KE_KEY entry into KE_IGNORE and any other keycode turns a KE_IGNORE
+ * entry back into KE_KEY. The keycodes whose bit in keybit may have to
+ * change are added to @touched, a KEY_CNT bit local bitmap, for
+ * sparse_keymap_core_update_keybit() to fix once, however many entries
+ * were set. The counts must be up to date.
+ */
+static inline void sparse_keymap_core_set_entry(struct sparse_keymap_core *core,
+                        struct key_entry *key, unsigned int keycode,
+                        unsigned long *touched)
+{
+    if (key->type == KE_KEY && key->keycode < KEY_CNT) {
+        core->keycode_count[key->keycode]--;
+        touched[key->keycode / SKC_LONG_BITS] |= 1UL << (key->keycode % SKC_LONG_BITS);
+    }
+
+    if (keycode == KEY_RESERVED) {
+        if (key->type == KE_KEY) key->type = KE_IGNORE;
+    } else {
+        if (key->type == KE_IGNORE) key->type = KE_KEY;
+    }
+    key->keycode = keycode;
+
+    if (key->type == KE_KEY) {
+        core->keycode_count[keycode]++;
+        touched[keycode / SKC_LONG_BITS] |= 1UL << (keycode % SKC_LONG_BITS);
+    }
+}
+
+static inline void sparse_keymap_core_update_keybit(const struct sparse_keymap_core *core,
+                            unsigned long *keybit,
+                            const unsigned long *touched)
+{
+    unsigned int w, keycode;
+    unsigned long bits;
+
+    for (w = 0; w < SKC_BITMAP_LONGS(KEY_CNT); w++) {
+        for (bits = touched[w]; bits; bits &= bits - 1) {
+            keycode = w * SKC_LONG_BITS + __builtin_ctzl(bits);
+            if (core->keycode_count[keycode])
+                SKC_SET_BIT(keycode, keybit);
+            else
+                SKC_CLEAR_BIT(keycode, keybit);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,196 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/debugfs.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/moduleparam.h>
+
+#include <linux/input.h>
+#include <linux/input/sparse-keymap.h>
+
+/*
+ * Virtual sparse keymap device for testing and benchmarking
+ * sparse-keymap-all without WMI hardware.
+ *
+ * The keymap has entries= entries with scancodes first, first + step, ...
+ * and ignore= percent of them KE_IGNORE, spread evenly like in dell_wmi
+ * tables; the KE_KEY ones cycle through keycodes from KEY_ESC on.
+ *
+ * Scancodes are injected through /sys/kernel/debug/sparse-keymap-test/inject:
+ * writing "scancode [count]" looks the scancode up count times with
+ * sparse_keymap_entry_from_scancode() and reports each hit with
+ * sparse_keymap_report_entry(), like a driver notify handler. Reading it
+ * back gives "scancode count found ns" for the last run, ns being the
+ * time taken by the whole loop.
+ *
+ *  # insmod sparse-keymap-test.ko entries=600 ignore=90
+ *  # echo 0x10000 100000 > /sys/kernel/debug/sparse-keymap-test/inject
+ *  # cat /sys/kernel/debug/sparse-keymap-test/inject
+ *
+ * Load it with and without sparse-keymap-all to compare; get/set costs
+ * can be measured from userspace with evmap on its event device.
+ */
+
+static unsigned int entries = 600;
+module_param(entries, uint, 0444);
+MODULE_PARM_DESC(entries, "Number of keymap entries (default: 600)");
+
+static unsigned int ignore = 90;
+module_param(ignore, uint, 0444);
+MODULE_PARM_DESC(ignore, "Percent of KE_IGNORE entries (default: 90)");
+
+static unsigned int first = 0x10000;
+module_param(first, uint, 0444);
+MODULE_PARM_DESC(first, "First scancode (default: 0x10000)");
+
+static unsigned int step = 7;
+module_param(step, uint, 0444);
+MODULE_PARM_DESC(step, "Scancode step between entries (default: 7)");
+
+#define INJECT_MAX 10000000
+
+static struct input_dev *test_dev;
+static struct dentry *debugfs_dir;
+static DEFINE_MUTEX(inject_lock);
+
+static struct {
+    u32 code;
+    unsigned int count, found;
+    u64 ns;
+} last;
+
+static struct key_entry *sparse_keymap_test_keymap(void)
+{
+    struct key_entry *keymap;
+    unsigned int i, keycode = KEY_ESC;
+
+    keymap = kcalloc(entries + 1, sizeof(*keymap), GFP_KERNEL);
+    if (!keymap)
+        return NULL;
+
+    for (i = 0; i < entries; i++) {
+        keymap[i].code = first + i * step;
+        // i * ignore / 100 steps once per KE_IGNORE entry
+        if ((i + 1) * ignore / 100 != i * ignore / 100) {
+            keymap[i].type = KE_IGNORE;
+        } else {
+            keymap[i].type = KE_KEY;
+            keymap[i].keycode = keycode;
+            if (++keycode > KEY_MICMUTE)
+                keycode = KEY_ESC;
+        }
+    }
+    keymap[entries].type = KE_END;
+    return keymap;
+}
+
+static ssize_t inject_write(struct file *file, const char __user *buf,
+                size_t count, loff_t *ppos)
+{
+    const struct key_entry *key;
+    unsigned int code, n = 1, i, found = 0;
+    char str[32];
+    ktime_t start;
+
+    if (count >= sizeof(str))
+        return -EINVAL;
+    if (copy_from_user(str, buf, count))
+        return -EFAULT;
+    str[count] = '\0';
+    if (sscanf(str, "%i %u", &code, &n) < 1 || !n || n > INJECT_MAX)
+        return -EINVAL;
+
+    mutex_lock(&inject_lock);
+    start = ktime_get();
+    for (i = 0; i < n; i++) {
+        key = sparse_keymap_entry_from_scancode(test_dev, code);
+        if (key) {
+            sparse_keymap_report_entry(test_dev, key, 1, true);
+            found++;
+        }
+        // long runs must not trip the soft lockup detector
+        if (i % 4096 == 4095)
+            cond_resched();
+    }
+    last.ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    last.code = code;
+    last.count = n;
+    last.found = found;
+    mutex_unlock(&inject_lock);
+    return count;
+}
+
+static ssize_t inject_read(struct file *file, char __user *buf,
+               size_t count, loff_t *ppos)
+{
+    char str[64];
+    int len;
+
+    mutex_lock(&inject_lock);
+    len = scnprintf(str, sizeof(str), "%08x %u %u %llu\n",
+            last.code, last.count, last.found, last.ns);
+    mutex_unlock(&inject_lock);
+    return simple_read_from_buffer(buf, count, ppos, str, len);
+}
+
+static const struct file_operations inject_fops = {
+    .owner = THIS_MODULE,
+    .open = simple_open,
+    .read = inject_read,
+    .write = inject_write,
+};
+
+static int __init sparse_keymap_test_init(void)
+{
+    struct key_entry *keymap;
+    int error;
+
+    if (!entries || ignore > 100)
+        return -EINVAL;
+
+    keymap = sparse_keymap_test_keymap();
+    if (!keymap)
+        return -ENOMEM;
+
+    test_dev = input_allocate_device();
+    if (!test_dev) {
+        error = -ENOMEM;
+        goto err_free_keymap;
+    }
+    test_dev->name = "Sparse keymap test";
+    test_dev->phys = "sparse-keymap-test/input0";
+    test_dev->id.bustype = BUS_VIRTUAL;
+
+    // sparse_keymap_setup() keeps its own devm copy of the keymap
+    error = sparse_keymap_setup(test_dev, keymap, NULL);
+    if (error)
+        goto err_free_dev;
+    error = input_register_device(test_dev);
+    if (error)
+        goto err_free_dev;
+    kfree(keymap);
+
+    debugfs_dir = debugfs_create_dir("sparse-keymap-test", NULL);
+    debugfs_create_file("inject", 0600, debugfs_dir, NULL, &inject_fops);
+    return 0;
+
+err_free_dev:
+    input_free_device(test_dev);
+err_free_keymap:
+    kfree(keymap);
+    return error;
+}
+
+static void __exit sparse_keymap_test_exit(void)
+{
+    debugfs_remove_recursive(debugfs_dir);
+    input_unregister_device(test_dev);
+}
+
+module_init(sparse_keymap_test_init)
+module_exit(sparse_keymap_test_exit)
+MODULE_LICENSE("GPL");
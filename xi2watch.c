@@ -245,75 +245,689 @@ Regards,
  */
 
 #define _XOPEN_SOURCE 600
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fnmatch.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/extensions/XI.h>
 #include <X11/extensions/XInput2.h>
+#ifdef XI2WATCH_XCB
+#include <errno.h>
+#include <poll.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/xinput.h>
+#endif
 
 static Display *display;
+static int xi_major, xi_error;
+static Atom node_atom, product_id_atom;
+#ifdef XI2WATCH_XCB
+static xcb_connection_t *conn;
+#endif
 
-static void connect_events(void)
+/*
+ * Event types that can be selected with -e, and the XI2 event each one
+ * maps to. Each type exports its own set of environment variables to the
+ * handler, on top of EVENT, DEVICE and DEVICE_NAME.
+ */
+static const struct {
+    const char *name;
+    int evtype;
+} event_types[] = {
+    { "hierarchy", XI_HierarchyChanged },
+    { "device", XI_DeviceChanged },
+    { "property", XI_PropertyEvent },
+};
+
+#define MAX_SELECTIONS 64
+
+/*
+ * What the server delivers is the union of what the handler asked for
+ * and what the built-in actions need; handler_masks keeps the former.
+ */
+static XIEventMask selections[MAX_SELECTIONS];
+static unsigned char selection_masks[MAX_SELECTIONS][XIMaskLen(XI_LASTEVENT)];
+static unsigned char handler_masks[MAX_SELECTIONS][XIMaskLen(XI_LASTEVENT)];
+static int nb_selections, nb_handler_selections;
+
+static void add_selection(const char *spec, int handler)
 {
-    XIEventMask m = { 0 };
+    const char *sep;
+    char *end;
+    size_t len;
+    int deviceid = XIAllDevices, evtype = -1, i;
+
+    sep = strchr(spec, ':');
+    len = sep != NULL ? (size_t)(sep - spec) : strlen(spec);
+    for (i = 0; i < (int)(sizeof(event_types) / sizeof(*event_types)); i++)
+        if (strlen(event_types[i].name) == len &&
+            strncmp(event_types[i].name, spec, len) == 0)
+            evtype = event_types[i].evtype;
+    if (evtype < 0) {
+        fprintf(stderr, "Unknown event type: %s\n", spec);
+        exit(1);
+    }
+    if (sep != NULL) {
+        if (strcmp(sep + 1, "all") == 0) {
+            deviceid = XIAllDevices;
+        } else if (strcmp(sep + 1, "master") == 0) {
+            deviceid = XIAllMasterDevices;
+        } else {
+            deviceid = strtol(sep + 1, &end, 0);
+            if (*end != 0 || end == sep + 1 || deviceid < 2) {
+                fprintf(stderr, "Invalid device: %s\n", spec);
+                exit(1);
+            }
+        }
+    }
+    /* The server refuses hierarchy events for individual devices. */
+    if (evtype == XI_HierarchyChanged &&
+        deviceid != XIAllDevices && deviceid != XIAllMasterDevices) {
+        fprintf(stderr, "hierarchy events can only be selected for all "
+            "or master devices\n");
+        exit(1);
+    }
+
+    for (i = 0; i < nb_selections; i++)
+        if (selections[i].deviceid == deviceid)
+            break;
+    if (i == nb_selections) {
+        if (nb_selections == MAX_SELECTIONS) {
+            fprintf(stderr, "Too many event selections\n");
+            exit(1);
+        }
+        selections[i].deviceid = deviceid;
+        selections[i].mask_len = sizeof(selection_masks[i]);
+        selections[i].mask = selection_masks[i];
+        nb_selections++;
+    }
+    XISetMask(selections[i].mask, evtype);
+    if (handler) {
+        XISetMask(handler_masks[i], evtype);
+        nb_handler_selections++;
+    }
+}
+
+static void connect_events(int actions)
+{
+    if (nb_handler_selections == 0)
+        add_selection("hierarchy", 1);
+    if (actions) {
+        add_selection("hierarchy", 0);
+        add_selection("property", 0);
+    }
+    XISelectEvents(display, DefaultRootWindow(display),
+        selections, nb_selections);
+}
+
+/*
+ * Events are copied out of the X queue into our own queue, so that the
+ * X connection can be drained while a handler runs. Events that do not
+ * fit, or that exceed the per-device rate (-r, handler events only), are
+ * collapsed into one summary event per device, queued once the queue has
+ * drained. The summary resyncs the actions whatever was lost; it only
+ * goes to the handler, as EVENT=dropped, if events it selected were
+ * among them (dropped, while lost counts all).
+ */
+#define EVENT_DROPPED (-1)
+
+typedef struct Event {
+    int type;
+    int deviceid;
+    XIHierarchyInfo hierarchy;
+    int sourceid, reason, num_classes;
+    Atom property;
+    int what;
+    unsigned long dropped, lost;
+} Event;
+
+#define MAX_DEVICES 256
+
+typedef struct Device {
+    double tokens;
+    struct timespec last;
+    Event summary;
+    char *name;
+    int name_pending;
+    unsigned applied, failed;
+    int use;
+    char *node, *phys, id[16];
+} Device;
+
+static Device device_table[MAX_DEVICES];
+static int pending_names[MAX_DEVICES], nb_pending_names;
+static double rate_limit = 0, rate_burst = 50;
+static int have_handler;
+static Event *queue;
+static int queue_max = 256, queue_head, queue_len;
+static unsigned long dropped_total;
+
+static int take_token(Device *dev)
+{
+    struct timespec now;
+    double elapsed;
+
+    if (rate_limit <= 0)
+        return 1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (dev->last.tv_sec == 0 && dev->last.tv_nsec == 0) {
+        dev->tokens = rate_burst;
+    } else {
+        elapsed = (now.tv_sec - dev->last.tv_sec) +
+            (now.tv_nsec - dev->last.tv_nsec) / 1e9;
+        dev->tokens += elapsed * rate_limit;
+        if (dev->tokens > rate_burst)
+            dev->tokens = rate_burst;
+    }
+    dev->last = now;
+    if (dev->tokens < 1)
+        return 0;
+    dev->tokens -= 1;
+    return 1;
+}
+
+static void drop_event(const Event *ev, int wanted)
+{
+    Event *sum;
+
+    if (wanted)
+        dropped_total++;
+    if (ev->deviceid < 0 || ev->deviceid >= MAX_DEVICES)
+        return;
+    sum = &device_table[ev->deviceid].summary;
+    if (sum->lost == 0) {
+        memset(sum, 0, sizeof(*sum));
+        sum->type = EVENT_DROPPED;
+        sum->deviceid = ev->deviceid;
+    }
+    sum->lost++;
+    if (wanted)
+        sum->dropped++;
+    if (ev->type == XI_HierarchyChanged) {
+        sum->hierarchy.flags |= ev->hierarchy.flags;
+        sum->hierarchy.enabled = ev->hierarchy.enabled;
+        sum->hierarchy.use = ev->hierarchy.use;
+        sum->hierarchy.attachment = ev->hierarchy.attachment;
+    }
+}
+
+/*
+ * Names are resolved when an event is queued, not when it is handled:
+ * by then a removed device can no longer be queried. They are cached
+ * until the device id is added again, together with the identity of the
+ * hardware behind the id: its evdev node, vendor:product and phys path.
+ */
+static void want_name(int deviceid, int refresh)
+{
+    Device *dev;
+
+    if (deviceid < 0 || deviceid >= MAX_DEVICES)
+        return;
+    dev = &device_table[deviceid];
+    if (dev->name_pending || (dev->name != NULL && !refresh))
+        return;
+    dev->name_pending = 1;
+    pending_names[nb_pending_names++] = deviceid;
+}
+
+static int is_master(int deviceid)
+{
+    int use;
+
+    if (deviceid < 0 || deviceid >= MAX_DEVICES)
+        return 0;
+    use = device_table[deviceid].use;
+    return use == XIMasterPointer || use == XIMasterKeyboard;
+}
+
+/*
+ * Actions select property events for all devices, so a master selection
+ * only matches masters. Hierarchy events cover every device whichever
+ * way they were selected.
+ */
+static int handler_wants(int evtype, int deviceid)
+{
+    int i;
+
+    for (i = 0; i < nb_selections; i++)
+        if (XIMaskIsSet(handler_masks[i], evtype) &&
+            (selections[i].deviceid == XIAllDevices ||
+             (selections[i].deviceid == XIAllMasterDevices &&
+              (evtype == XI_HierarchyChanged || is_master(deviceid))) ||
+             selections[i].deviceid == deviceid))
+            return 1;
+    return 0;
+}
 
-    m.deviceid = XIAllDevices;
-    m.mask_len = XIMaskLen(XI_LASTEVENT);
-    m.mask = calloc(1, m.mask_len);
-    if (m.mask == NULL)
+static void set_name(int deviceid, const char *name, size_t len)
+{
+    Device *dev = &device_table[deviceid];
+
+    free(dev->name);
+    dev->name = malloc(len + 1);
+    if (dev->name == NULL)
+        abort();
+    memcpy(dev->name, name, len);
+    dev->name[len] = 0;
+}
+
+static void set_identity(int deviceid, const char *node, size_t len,
+    const int32_t *product_id)
+{
+    Device *dev = &device_table[deviceid];
+    const char *base;
+    char path[128], buf[256];
+    FILE *f;
+
+    free(dev->node);
+    free(dev->phys);
+    dev->node = dev->phys = NULL;
+    dev->id[0] = 0;
+    if (product_id != NULL)
+        snprintf(dev->id, sizeof(dev->id), "%04x:%04x",
+            (unsigned)product_id[0] & 0xffff, (unsigned)product_id[1] & 0xffff);
+    if (node == NULL)
+        return;
+    base = memchr(node, 0, len);
+    if (base != NULL)
+        len = base - node;
+    dev->node = malloc(len + 1);
+    if (dev->node == NULL)
         abort();
-    XISetMask(m.mask, XI_HierarchyChanged);
-    XISelectEvents(display, DefaultRootWindow(display), &m, 1);
-    free(m.mask);
+    memcpy(dev->node, node, len);
+    dev->node[len] = 0;
+
+    /* The phys path is readable by anybody, unlike the node itself. */
+    base = strrchr(dev->node, '/');
+    snprintf(path, sizeof(path), "/sys/class/input/%s/device/phys",
+        base != NULL ? base + 1 : dev->node);
+    f = fopen(path, "r");
+    if (f == NULL)
+        return;
+    if (fgets(buf, sizeof(buf), f) != NULL) {
+        buf[strcspn(buf, "\n")] = 0;
+        if (buf[0] != 0) {
+            dev->phys = strdup(buf);
+            if (dev->phys == NULL)
+                abort();
+        }
+    }
+    fclose(f);
+}
+
+/* limited: a new event, not a summary; only handler events are limited */
+static void enqueue(const Event *ev, int limited)
+{
+    int wanted = limited && have_handler && handler_wants(ev->type, ev->deviceid);
+
+    if (wanted && ev->deviceid >= 0 && ev->deviceid < MAX_DEVICES &&
+        !take_token(&device_table[ev->deviceid])) {
+        drop_event(ev, wanted);
+        return;
+    }
+    if (queue_len == queue_max) {
+        drop_event(ev, wanted);
+        return;
+    }
+    queue[(queue_head + queue_len++) % queue_max] = *ev;
+    if (ev->type == XI_HierarchyChanged && ev->deviceid >= 0 &&
+        ev->deviceid < MAX_DEVICES)
+        device_table[ev->deviceid].use = ev->hierarchy.use;
+    want_name(ev->deviceid, ev->type == XI_HierarchyChanged &&
+        (ev->hierarchy.flags & (XIMasterAdded | XISlaveAdded)));
+}
+
+static void flush_summaries(void)
+{
+    Event *sum;
+    int i;
+
+    for (i = 0; i < MAX_DEVICES && queue_len < queue_max; i++) {
+        sum = &device_table[i].summary;
+        if (sum->lost == 0)
+            continue;
+        if (sum->dropped > 0)
+            fprintf(stderr, "xi2watch: device %d: %lu events dropped, %lu total\n",
+                i, sum->dropped, dropped_total);
+        enqueue(sum, 0);
+        sum->dropped = sum->lost = 0;
+    }
+}
+
+static const char *event_name(int type)
+{
+    unsigned i;
+
+    if (type == EVENT_DROPPED)
+        return "dropped";
+    for (i = 0; i < sizeof(event_types) / sizeof(*event_types); i++)
+        if (event_types[i].evtype == type)
+            return event_types[i].name;
+    return "unknown";
+}
+
+static void hierarchy_env(const XIHierarchyInfo *info)
+{
+    char typebuf[32], *type;
+
+    setenv("ENABLED", info->enabled ? "1" : "0", 1);
+    #define ENV_FLAG(e, f) \
+        setenv("FLAG_" e, (info->flags & f) ? "1" : "0", 1)
+    ENV_FLAG("MASTER_ADDED", XIMasterAdded);
+    ENV_FLAG("MASTER_REMOVED", XIMasterRemoved);
+    ENV_FLAG("SLAVE_ADDED", XISlaveAdded);
+    ENV_FLAG("SLAVE_REMOVED", XISlaveRemoved);
+    ENV_FLAG("SLAVE_ATTACHED", XISlaveAttached);
+    ENV_FLAG("SLAVE_DETACHED", XISlaveDetached);
+    ENV_FLAG("DEVICE_ENABLED", XIDeviceEnabled);
+    ENV_FLAG("DEVICE_DISABLED", XIDeviceDisabled);
+    switch (info->use) {
+        case 0: type = "none"; break;
+        case XIMasterPointer: type = "master_pointer"; break;
+        case XIMasterKeyboard: type = "master_keyboard"; break;
+        case XISlavePointer: type = "slave_pointer"; break;
+        case XISlaveKeyboard: type = "slave_keyboard"; break;
+        case XIFloatingSlave: type = "floating_slave"; break;
+        default:
+            snprintf(typebuf, sizeof(typebuf), "unknown_%d", info->use);
+            type = typebuf;
+            break;
+    }
+    setenv("USE", type, 1);
+}
+
+static void device_changed_env(const Event *ev)
+{
+    char buf[32];
+
+    snprintf(buf, sizeof(buf), "%d", ev->sourceid);
+    setenv("SOURCE", buf, 1);
+    setenv("REASON", ev->reason == XISlaveSwitch ? "slave_switch" :
+        ev->reason == XIDeviceChange ? "device_change" : "unknown", 1);
+    snprintf(buf, sizeof(buf), "%d", ev->num_classes);
+    setenv("NUM_CLASSES", buf, 1);
+}
+
+static void property_env(const Event *ev, const char *name)
+{
+    if (name != NULL)
+        setenv("PROPERTY", name, 1);
+    setenv("PROPERTY_STATE", ev->what == XIPropertyCreated ? "created" :
+        ev->what == XIPropertyDeleted ? "deleted" : "modified", 1);
+}
+
+/*
+ * A summary stands for all the events dropped for a device; hierarchy
+ * flags are the union of the dropped ones, so the handler can resync.
+ */
+static void dropped_env(const Event *ev)
+{
+    char buf[32];
+
+    snprintf(buf, sizeof(buf), "%lu", ev->dropped);
+    setenv("DROPPED", buf, 1);
+    snprintf(buf, sizeof(buf), "%lu", dropped_total);
+    setenv("DROPPED_TOTAL", buf, 1);
+    if (ev->hierarchy.flags != 0)
+        hierarchy_env(&ev->hierarchy);
 }
 
-static void run_command(char **cmd, XIHierarchyInfo *info)
+/*
+ * Built-in actions set device properties directly, without a handler:
+ * -m selects the devices (a glob on the name) for the -s that follow.
+ * Atoms are interned once at startup. A bit in Device.applied means the
+ * property is known to hold the value, so nothing is sent at all; it is
+ * cleared when the device is (re)added or when someone else changes the
+ * property, and then the value is only rewritten if it differs.
+ */
+#define MAX_ACTIONS 32
+#define MAX_VALUES 16
+
+typedef struct Action {
+    const char *match;
+    int field;
+    char *property;
+    Atom atom;
+    int nb_values;
+    double values[MAX_VALUES];
+} Action;
+
+enum { MATCH_NAME, MATCH_NODE, MATCH_PHYS, MATCH_ID };
+
+static Action actions[MAX_ACTIONS];
+static int nb_actions;
+static Atom float_atom;
+
+static void add_action(const char *match, const char *def)
 {
-    XIDeviceInfo *devices;
-    char idbuf[32], typebuf[32], *type;
+    Action *a;
+    const char *sep;
+    char *end;
+
+    sep = strchr(def, '=');
+    if (sep == NULL || sep == def) {
+        fprintf(stderr, "Invalid action: %s\n", def);
+        exit(1);
+    }
+    if (nb_actions == MAX_ACTIONS) {
+        fprintf(stderr, "Too many actions\n");
+        exit(1);
+    }
+    a = &actions[nb_actions];
+    a->field = MATCH_NAME;
+    if (strncmp(match, "node=", 5) == 0)
+        a->field = MATCH_NODE, match += 5;
+    else if (strncmp(match, "phys=", 5) == 0)
+        a->field = MATCH_PHYS, match += 5;
+    else if (strncmp(match, "id=", 3) == 0)
+        a->field = MATCH_ID, match += 3;
+    else if (strncmp(match, "name=", 5) == 0)
+        match += 5;
+    a->match = match;
+    a->property = malloc(sep - def + 1);
+    if (a->property == NULL)
+        abort();
+    memcpy(a->property, def, sep - def);
+    a->property[sep - def] = 0;
+    for (sep++; *sep != 0; sep = end) {
+        if (a->nb_values == MAX_VALUES) {
+            fprintf(stderr, "Too many values: %s\n", def);
+            exit(1);
+        }
+        a->values[a->nb_values++] = strtod(sep, &end);
+        if (end == sep || (*end != 0 && *end != ',')) {
+            fprintf(stderr, "Invalid value: %s\n", def);
+            exit(1);
+        }
+        if (*end == ',')
+            end++;
+    }
+    if (a->nb_values == 0) {
+        fprintf(stderr, "Missing value: %s\n", def);
+        exit(1);
+    }
+    nb_actions++;
+}
+
+static void intern_atoms(void)
+{
+    char *names[MAX_ACTIONS + 3];
+    Atom atoms[MAX_ACTIONS + 3];
+    int i;
+
+    for (i = 0; i < nb_actions; i++)
+        names[i] = actions[i].property;
+    names[nb_actions] = "FLOAT";
+    names[nb_actions + 1] = "Device Node";
+    names[nb_actions + 2] = "Device Product ID";
+    XInternAtoms(display, names, nb_actions + 3, False, atoms);
+    for (i = 0; i < nb_actions; i++)
+        actions[i].atom = atoms[i];
+    float_atom = atoms[nb_actions];
+    node_atom = atoms[nb_actions + 1];
+    product_id_atom = atoms[nb_actions + 2];
+}
+
+static int action_matches(const Action *a, const Device *dev)
+{
+    const char *value;
+
+    switch (a->field) {
+        case MATCH_NODE: value = dev->node; break;
+        case MATCH_PHYS: value = dev->phys; break;
+        case MATCH_ID: value = dev->id[0] != 0 ? dev->id : NULL; break;
+        default: value = dev->name; break;
+    }
+    return value != NULL && fnmatch(a->match, value, 0) == 0;
+}
+
+static void apply_action(int deviceid, int i)
+{
+    Action *a = &actions[i];
+    Atom type;
+    unsigned char *data = NULL;
+    unsigned long nb_items, after, j;
+    long length = MAX_VALUES, v;
+    int format, changed = 0;
+    float f;
+
+    /*
+     * The whole property is written back, so it must be read whole: the
+     * length is in 4 byte units and bytes_after says how much was left.
+     */
+    if (XIGetProperty(display, deviceid, a->atom, 0, length, False,
+        AnyPropertyType, &type, &format, &nb_items, &after, &data) != Success)
+        return;
+    if (after > 0) {
+        length += (after + 3) / 4;
+        XFree(data);
+        data = NULL;
+        if (XIGetProperty(display, deviceid, a->atom, 0, length, False,
+            AnyPropertyType, &type, &format, &nb_items, &after, &data) != Success)
+            return;
+        /* Changed between the two requests, next event will retry. */
+        if (after > 0)
+            goto out;
+    }
+    /* Not there (yet): it will be retried when the device is enabled. */
+    if (type == None || nb_items < (unsigned long)a->nb_values)
+        goto out;
+    /* Reported once, not retried until the device is added again. */
+    if (type != XA_INTEGER && type != float_atom) {
+        fprintf(stderr, "xi2watch: %s: unsupported property type\n",
+            a->property);
+        device_table[deviceid].failed |= 1U << i;
+        goto out;
+    }
+    for (j = 0; j < (unsigned long)a->nb_values; j++) {
+        if (type == float_atom && format == 32) {
+            f = a->values[j];
+            changed |= memcmp(data + j * 4, &f, 4) != 0;
+            memcpy(data + j * 4, &f, 4);
+            continue;
+        }
+        v = a->values[j];
+        switch (format) {
+            case 8:
+                changed |= ((int8_t *)data)[j] != v;
+                ((int8_t *)data)[j] = v;
+                break;
+            case 16:
+                changed |= ((int16_t *)data)[j] != v;
+                ((int16_t *)data)[j] = v;
+                break;
+            case 32:
+                changed |= ((int32_t *)data)[j] != v;
+                ((int32_t *)data)[j] = v;
+                break;
+        }
+    }
+    if (changed)
+        XIChangeProperty(display, deviceid, a->atom, type, format,
+            PropModeReplace, data, nb_items);
+    device_table[deviceid].applied |= 1U << i;
+out:
+    XFree(data);
+}
+
+static void apply_actions(const Event *ev)
+{
+    Device *dev;
+    int i, all;
+
+    if (ev->deviceid < 0 || ev->deviceid >= MAX_DEVICES)
+        return;
+    dev = &device_table[ev->deviceid];
+    all = (ev->type == XI_HierarchyChanged || ev->type == EVENT_DROPPED) &&
+        (ev->hierarchy.flags & (XIMasterAdded | XISlaveAdded |
+                                XIDeviceEnabled | XISlaveAttached));
+    if (ev->type == XI_DeviceChanged && ev->reason == XIDeviceChange)
+        all = 1;
+    if (all)
+        dev->applied = dev->failed = 0;
+    if (ev->type == XI_HierarchyChanged && !ev->hierarchy.enabled)
+        return;
+    for (i = 0; i < nb_actions; i++) {
+        if (ev->type == XI_PropertyEvent && ev->property == actions[i].atom)
+            dev->applied &= ~(1U << i);
+        if (((dev->applied | dev->failed) & (1U << i)) ||
+            !action_matches(&actions[i], dev))
+            continue;
+        if (all || ev->type == XI_PropertyEvent)
+            apply_action(ev->deviceid, i);
+    }
+}
+
+static void identity_env(const Device *dev)
+{
+    char buf[8];
+
+    if (dev->name != NULL)
+        setenv("DEVICE_NAME", dev->name, 1);
+    if (dev->node != NULL)
+        setenv("DEVICE_NODE", dev->node, 1);
+    if (dev->phys != NULL)
+        setenv("DEVICE_PHYS", dev->phys, 1);
+    if (dev->id[0] != 0) {
+        setenv("DEVICE_ID", dev->id, 1);
+        snprintf(buf, sizeof(buf), "%.4s", dev->id);
+        setenv("DEVICE_VENDOR", buf, 1);
+        setenv("DEVICE_PRODUCT", dev->id + 5, 1);
+    }
+}
+
+static void run_command(char **cmd, const Event *ev)
+{
+    char idbuf[32], *property = NULL;
     pid_t child;
-    int nb_devices = 0, status, i;
+    int status;
 
-    devices = XIQueryDevice(display, 0, &nb_devices);
-    snprintf(idbuf, sizeof(idbuf), "%d", info->deviceid);
+    /* Resolve the atom here: the child must not talk to the server. */
+    if (ev->type == XI_PropertyEvent)
+        property = XGetAtomName(display, ev->property);
+    snprintf(idbuf, sizeof(idbuf), "%d", ev->deviceid);
     child = fork();
     if (child < 0) {
         perror("fork");
-        return;
+        goto out;
     }
     if (child == 0) {
+        setenv("EVENT", event_name(ev->type), 1);
         setenv("DEVICE", idbuf, 1);
-        for (i = 0; i < nb_devices; i++) {
-            if (devices[i].deviceid == info->deviceid) {
-                setenv("DEVICE_NAME", devices[i].name, 1);
-                break;
-            }
+        if (ev->deviceid >= 0 && ev->deviceid < MAX_DEVICES)
+            identity_env(&device_table[ev->deviceid]);
+        switch (ev->type) {
+            case XI_HierarchyChanged: hierarchy_env(&ev->hierarchy); break;
+            case XI_DeviceChanged: device_changed_env(ev); break;
+            case XI_PropertyEvent: property_env(ev, property); break;
+            case EVENT_DROPPED: dropped_env(ev); break;
         }
-        setenv("ENABLED", info->enabled ? "1" : "0", 1);
-        #define ENV_FLAG(e, f) \
-            setenv("FLAG_" e, (info->flags & f) ? "1" : "0", 1)
-        ENV_FLAG("MASTER_ADDED", XIMasterAdded);
-        ENV_FLAG("MASTER_REMOVED", XIMasterRemoved);
-        ENV_FLAG("SLAVE_ADDED", XISlaveAdded);
-        ENV_FLAG("SLAVE_REMOVED", XISlaveRemoved);
-        ENV_FLAG("SLAVE_ATTACHED", XISlaveAttached);
-        ENV_FLAG("SLAVE_DETACHED", XISlaveDetached);
-        ENV_FLAG("DEVICE_ENABLED", XIDeviceEnabled);
-        ENV_FLAG("DEVICE_DISABLED", XIDeviceDisabled);
-        switch (info->use) {
-            case 0: type = "none"; break;
-            case XIMasterPointer: type = "master_pointer"; break;
-            case XIMasterKeyboard: type = "master_keyboard"; break;
-            case XISlavePointer: type = "slave_pointer"; break;
-            case XISlaveKeyboard: type = "slave_keyboard"; break;
-            case XIFloatingSlave: type = "floating_slave"; break;
-            default:
-                snprintf(typebuf, sizeof(typebuf), "unknown_%d", info->use);
-                type = typebuf;
-                break;
-        }
-        setenv("USE", type, 1);
         execvp(cmd[0], cmd);
         perror("exec");
         _exit(1);
@@ -323,48 +937,385 @@ static void run_command(char **cmd, XIHierarchyInfo *info)
     if (status != 0)
         fprintf(stderr, "Child failed\n");
 
-    XIFreeDeviceInfo(devices);
+out:
+    if (property != NULL)
+        XFree(property);
+}
+
+/* Devices vanish all the time; queries about them must not be fatal. */
+static int x_error(Display *dpy, XErrorEvent *err)
+{
+    char msg[256];
+
+    if (err->error_code == xi_error + XI_BadDevice)
+        return 0;
+    XGetErrorText(dpy, err->error_code, msg, sizeof(msg));
+    fprintf(stderr, "X error: %s\n", msg);
+    return 0;
 }
 
-static void hierarchy_changed(XIHierarchyEvent *ev, char **cmd)
+#ifdef XI2WATCH_XCB
+
+/*
+ * XCB backend: events are parsed in place from the wire buffer, the
+ * connection is waited on with poll(), and the device queries of a whole
+ * batch of events are pipelined. Xlib is still used for requests, with
+ * XCB owning the event queue.
+ */
+static void read_wire_event(xcb_generic_event_t *gev)
 {
+    xcb_ge_generic_event_t *ge = (xcb_ge_generic_event_t *)gev;
+    xcb_input_hierarchy_event_t *he;
+    xcb_input_hierarchy_info_t *info;
+    xcb_input_device_changed_event_t *dc;
+    xcb_input_property_event_t *pe;
+    Event ev;
     int i;
-    XIHierarchyInfo *info;
 
-    for (i = 0; i < ev->num_info; i++) {
-        info = &ev->info[i];
-        if (info->flags != 0)
-            run_command(cmd, info);
+    if ((gev->response_type & 0x7f) != XCB_GE_GENERIC ||
+        ge->extension != xi_major)
+        return;
+    memset(&ev, 0, sizeof(ev));
+    switch (ge->event_type) {
+        case XCB_INPUT_HIERARCHY:
+            he = (xcb_input_hierarchy_event_t *)gev;
+            info = xcb_input_hierarchy_infos(he);
+            ev.type = XI_HierarchyChanged;
+            for (i = 0; i < he->num_infos; i++) {
+                if (info[i].flags == 0)
+                    continue;
+                ev.deviceid = info[i].deviceid;
+                ev.hierarchy.deviceid = info[i].deviceid;
+                ev.hierarchy.attachment = info[i].attachment;
+                ev.hierarchy.use = info[i].type;
+                ev.hierarchy.enabled = info[i].enabled;
+                ev.hierarchy.flags = info[i].flags;
+                enqueue(&ev, 1);
+            }
+            break;
+        case XCB_INPUT_DEVICE_CHANGED:
+            dc = (xcb_input_device_changed_event_t *)gev;
+            ev.type = XI_DeviceChanged;
+            ev.deviceid = dc->deviceid;
+            ev.sourceid = dc->sourceid;
+            ev.reason = dc->reason;
+            ev.num_classes = dc->num_classes;
+            enqueue(&ev, 1);
+            break;
+        case XCB_INPUT_PROPERTY:
+            pe = (xcb_input_property_event_t *)gev;
+            ev.type = XI_PropertyEvent;
+            ev.deviceid = pe->deviceid;
+            ev.property = pe->property;
+            ev.what = pe->what;
+            enqueue(&ev, 1);
+            break;
     }
 }
 
-int main(int argc, char **argv)
+static xcb_input_xi_get_property_reply_t *get_property_reply(
+    xcb_input_xi_get_property_cookie_t cookie, xcb_atom_t type, int format)
 {
-    XEvent ev;
-    int xi_major, xi_event, xi_error;
+    xcb_input_xi_get_property_reply_t *reply;
+    xcb_generic_error_t *err = NULL;
+
+    reply = xcb_input_xi_get_property_reply(conn, cookie, &err);
+    free(err);
+    if (reply != NULL && (reply->type != type || reply->format != format)) {
+        free(reply);
+        reply = NULL;
+    }
+    return reply;
+}
 
-    if (argc < 2) {
-        fprintf(stderr, "Usage: xi2watch /path/to/handler [handler args]\n");
-        exit(1);
+static void resolve_devices(void)
+{
+    xcb_input_xi_query_device_cookie_t cookies[MAX_DEVICES];
+    xcb_input_xi_get_property_cookie_t nodes[MAX_DEVICES];
+    xcb_input_xi_get_property_cookie_t product_ids[MAX_DEVICES];
+    xcb_input_xi_query_device_reply_t *reply;
+    xcb_input_xi_get_property_reply_t *node, *product_id;
+    xcb_input_xi_device_info_iterator_t it;
+    xcb_generic_error_t *err;
+    int i, id;
+
+    for (i = 0; i < nb_pending_names; i++) {
+        id = pending_names[i];
+        cookies[i] = xcb_input_xi_query_device(conn, id);
+        nodes[i] = xcb_input_xi_get_property(conn, id, 0, node_atom,
+            XCB_ATOM_STRING, 0, 256);
+        product_ids[i] = xcb_input_xi_get_property(conn, id, 0,
+            product_id_atom, XCB_ATOM_INTEGER, 0, 2);
+    }
+    for (i = 0; i < nb_pending_names; i++) {
+        id = pending_names[i];
+        err = NULL;
+        reply = xcb_input_xi_query_device_reply(conn, cookies[i], &err);
+        free(err);
+        if (reply != NULL) {
+            it = xcb_input_xi_query_device_infos_iterator(reply);
+            if (it.rem > 0) {
+                set_name(id, xcb_input_xi_device_info_name(it.data),
+                    xcb_input_xi_device_info_name_length(it.data));
+                device_table[id].use = it.data->type;
+            }
+            free(reply);
+        }
+        node = get_property_reply(nodes[i], XCB_ATOM_STRING, 8);
+        product_id = get_property_reply(product_ids[i], XCB_ATOM_INTEGER, 32);
+        if (product_id != NULL && product_id->num_items < 2) {
+            free(product_id);
+            product_id = NULL;
+        }
+        set_identity(id,
+            node != NULL ? xcb_input_xi_get_property_items(node) : NULL,
+            node != NULL ? node->num_items : 0,
+            product_id != NULL ? xcb_input_xi_get_property_items(product_id) : NULL);
+        free(node);
+        free(product_id);
+        device_table[id].name_pending = 0;
+    }
+    nb_pending_names = 0;
+}
+
+static void read_events(int block)
+{
+    xcb_generic_event_t *gev;
+    struct pollfd pfd;
+
+    pfd.fd = xcb_get_file_descriptor(conn);
+    pfd.events = POLLIN;
+    while ((gev = xcb_poll_for_event(conn)) == NULL && block) {
+        if (xcb_connection_has_error(conn)) {
+            fprintf(stderr, "X connection lost\n");
+            exit(1);
+        }
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            perror("poll");
+            exit(1);
+        }
+    }
+    for (; gev != NULL; gev = xcb_poll_for_event(conn)) {
+        read_wire_event(gev);
+        free(gev);
+    }
+    resolve_devices();
+}
+
+#else
+
+static void read_event(void)
+{
+    XEvent xev;
+    XIHierarchyEvent *he;
+    XIDeviceChangedEvent *dc;
+    XIPropertyEvent *pe;
+    Event ev;
+    int i;
+
+    XNextEvent(display, &xev);
+    if (xev.type != GenericEvent || xev.xcookie.extension != xi_major ||
+        !XGetEventData(display, &xev.xcookie))
+        return;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = xev.xcookie.evtype;
+    switch (ev.type) {
+        case XI_HierarchyChanged:
+            he = xev.xcookie.data;
+            for (i = 0; i < he->num_info; i++) {
+                if (he->info[i].flags == 0)
+                    continue;
+                ev.deviceid = he->info[i].deviceid;
+                ev.hierarchy = he->info[i];
+                enqueue(&ev, 1);
+            }
+            break;
+        case XI_DeviceChanged:
+            dc = xev.xcookie.data;
+            ev.deviceid = dc->deviceid;
+            ev.sourceid = dc->sourceid;
+            ev.reason = dc->reason;
+            ev.num_classes = dc->num_classes;
+            enqueue(&ev, 1);
+            break;
+        case XI_PropertyEvent:
+            pe = xev.xcookie.data;
+            ev.deviceid = pe->deviceid;
+            ev.property = pe->property;
+            ev.what = pe->what;
+            enqueue(&ev, 1);
+            break;
+    }
+    XFreeEventData(display, &xev.xcookie);
+}
+
+static unsigned char *get_property(int deviceid, Atom property, Atom type,
+    int format, unsigned long *nb_items)
+{
+    Atom type_ret;
+    unsigned char *data = NULL;
+    unsigned long after;
+    int format_ret;
+
+    if (XIGetProperty(display, deviceid, property, 0, 256, False, type,
+        &type_ret, &format_ret, nb_items, &after, &data) != Success)
+        return NULL;
+    if (type_ret != type || format_ret != format) {
+        XFree(data);
+        return NULL;
     }
+    return data;
+}
+
+static void resolve_devices(void)
+{
+    XIDeviceInfo *info;
+    unsigned char *node, *product_id;
+    unsigned long nb_node, nb_product_id;
+    int i, id, nb;
+
+    for (i = 0; i < nb_pending_names; i++) {
+        id = pending_names[i];
+        info = XIQueryDevice(display, id, &nb);
+        if (info != NULL) {
+            if (nb > 0) {
+                set_name(id, info->name, strlen(info->name));
+                device_table[id].use = info->use;
+            }
+            XIFreeDeviceInfo(info);
+        }
+        node = get_property(id, node_atom, XA_STRING, 8, &nb_node);
+        product_id = get_property(id, product_id_atom, XA_INTEGER, 32,
+            &nb_product_id);
+        set_identity(id, (char *)node,
+            node != NULL ? nb_node : 0,
+            product_id != NULL && nb_product_id >= 2 ?
+                (int32_t *)product_id : NULL);
+        if (node != NULL)
+            XFree(node);
+        if (product_id != NULL)
+            XFree(product_id);
+        device_table[id].name_pending = 0;
+    }
+    nb_pending_names = 0;
+}
+
+static void read_events(int block)
+{
+    if (block)
+        read_event();
+    while (XPending(display))
+        read_event();
+    resolve_devices();
+}
+
+#endif
+
+static void usage(int ret)
+{
+    FILE *out = ret ? stderr : stdout;
+
+    fprintf(out,
+        "Usage: xi2watch [options] [/path/to/handler [handler args]]\n"
+        "\n"
+        "    -e event[:device]  select an event type for a device id,\n"
+        "                       \"all\" (default) or \"master\";\n"
+        "                       events: hierarchy (default), device, property\n"
+        "    -r rate[:burst]    allow rate handler events/s per device, with\n"
+        "                       bursts of burst events (default burst 50;\n"
+        "                       default: no limit)\n"
+        "    -q size            queue at most size events (default 256)\n"
+        "    -m pattern         apply the following -s to devices whose name\n"
+        "                       matches the pattern (default: all devices)\n"
+        "    -s prop=value[,value...]\n"
+        "                       set an integer or float device property\n"
+        "                       (the handler is optional when -s is used)\n"
+        "    -h                 print this message\n"
+        );
+    exit(ret);
+}
+
+int main(int argc, char **argv)
+{
+    Event ev;
+    const char *match = "*";
+    char **cmd;
+    int xi_event, opt, off;
+
+    while ((opt = getopt(argc, argv, "+e:r:q:m:s:h")) >= 0) {
+        switch (opt) {
+            case 'e':
+                add_selection(optarg, 1);
+                break;
+            case 'm':
+                match = optarg;
+                break;
+            case 's':
+                add_action(match, optarg);
+                break;
+            case 'r':
+                off = 0;
+                if (sscanf(optarg, "%lf%n", &rate_limit, &off) != 1 ||
+                    (optarg[off] != 0 && (optarg[off] != ':' ||
+                    sscanf(optarg + off + 1, "%lf", &rate_burst) != 1)) ||
+                    rate_burst < 1) {
+                    fprintf(stderr, "Invalid rate: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'q':
+                queue_max = atoi(optarg);
+                if (queue_max < 1) {
+                    fprintf(stderr, "Invalid queue size: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'h':
+                usage(0);
+                break;
+            default:
+                usage(1);
+                break;
+        }
+    }
+    if (optind >= argc && nb_actions == 0)
+        usage(1);
+    cmd = optind < argc ? argv + optind : NULL;
+    have_handler = cmd != NULL;
+    queue = calloc(queue_max, sizeof(*queue));
+    if (queue == NULL)
+        abort();
     display = XOpenDisplay(NULL);
     if (display == NULL) {
         fprintf(stderr, "Unable to open display\n");
         exit(1);
     }
+#ifdef XI2WATCH_XCB
+    conn = XGetXCBConnection(display);
+    XSetEventQueueOwner(display, XCBOwnsEventQueue);
+#endif
     if (!XQueryExtension(display, "XInputExtension", &xi_major, &xi_event, &xi_error)) {
         fprintf(stderr, "XI2 not available\n");
         exit(1);
     }
 
-    connect_events();
+    XSetErrorHandler(x_error);
+    intern_atoms();
+    connect_events(nb_actions > 0);
 
     while (1) {
-        XNextEvent(display, &ev);
-        if (ev.type == GenericEvent && ev.xcookie.extension == xi_major &&
-            XGetEventData(display, &ev.xcookie)) {
-            if (ev.xcookie.evtype == XI_HierarchyChanged)
-                hierarchy_changed(ev.xcookie.data, argv + 1);
+        if (queue_len == 0)
+            flush_summaries();
+        /* Drain the connection before every handler run. */
+        read_events(queue_len == 0);
+        if (queue_len > 0) {
+            ev = queue[queue_head];
+            queue_head = (queue_head + 1) % queue_max;
+            queue_len--;
+            apply_actions(&ev);
+            if (cmd != NULL && (ev.type == EVENT_DROPPED ? ev.dropped > 0 :
+                handler_wants(ev.type, ev.deviceid)))
+                run_command(cmd, &ev);
         }
     }
 